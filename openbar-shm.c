@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2024 Gonzalo Rodriguez <gonzalo@x61.sh>
+ * Copyright (c) 2024-2026 David David Uhden Collado <david@uhden.dev>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE // BSD and POSIX interfaces hidden by -std=c99
+#endif
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "openbar-shm.h"
+
+// Attempts at a consistent copy before openbar_shm_read() gives up on a
+// writer that keeps the seqlock busy
+#define SHM_READ_TRIES 1000
+
+// Name the region after the user, so that every user runs a daemon of
+// their own
+static void
+shm_name(char *name, size_t size)
+{
+	snprintf(name, size, "/openbar.%lu", (unsigned long)getuid());
+}
+
+// Return whether the region left under name belongs to a daemon that is
+// still running. A region that cannot be read, or that another layout
+// version left, is stale.
+static bool
+shm_owner_alive(const char *name)
+{
+	const struct OpenbarShm *shm;
+	struct stat st;
+	pid_t pid = 0;
+	int fd;
+
+	if ((fd = shm_open(name, O_RDONLY, 0)) == -1)
+		return false;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*shm)) {
+		close(fd);
+		return false;
+	}
+	shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+		return false;
+	if (shm->magic == OPENBAR_SHM_MAGIC)
+		pid = (pid_t)shm->pid;
+	munmap((void *)shm, sizeof(*shm));
+
+	return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+// Create the shared region and map it for writing. A region left by a
+// daemon that died is replaced; while its daemon runs, another one
+// would overwrite its values and remove it on exit, so NULL is returned
+// with errno set to EEXIST. Returns NULL with errno set on failure.
+struct OpenbarShm *
+openbar_shm_create(void)
+{
+	struct OpenbarShm *shm;
+	char name[64];
+	int fd;
+
+	shm_name(name, sizeof(name));
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd == -1 && errno == EEXIST) {
+		if (shm_owner_alive(name)) {
+			errno = EEXIST;
+			return NULL;
+		}
+		shm_unlink(name);
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	}
+	if (fd == -1)
+		return NULL;
+	if (ftruncate(fd, sizeof(*shm)) == -1) {
+		close(fd);
+		return NULL;
+	}
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+	    0);
+	close(fd);
+	if (shm == MAP_FAILED)
+		return NULL;
+
+	openbar_shm_write_begin(shm);
+	memset((char *)shm + offsetof(struct OpenbarShm, updated), 0,
+	    sizeof(*shm) - offsetof(struct OpenbarShm, updated));
+	shm->magic = OPENBAR_SHM_MAGIC;
+	shm->version = OPENBAR_SHM_VERSION;
+	shm->size = sizeof(*shm);
+	shm->pid = getpid();
+	openbar_shm_write_end(shm);
+	return shm;
+}
+
+// Open the write section: readers retry until it is closed
+void
+openbar_shm_write_begin(struct OpenbarShm *shm)
+{
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// Close the write section
+void
+openbar_shm_write_end(struct OpenbarShm *shm)
+{
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Unmap the region and remove its name
+void
+openbar_shm_destroy(struct OpenbarShm *shm)
+{
+	char name[64];
+
+	munmap(shm, sizeof(*shm));
+	shm_name(name, sizeof(name));
+	shm_unlink(name);
+}
+
+// Map the region of the running daemon read-only. Returns NULL with
+// errno set when there is none.
+const struct OpenbarShm *
+openbar_shm_attach(void)
+{
+	const struct OpenbarShm *shm;
+	struct stat st;
+	char name[64];
+	int fd;
+
+	shm_name(name, sizeof(name));
+	if ((fd = shm_open(name, O_RDONLY, 0)) == -1)
+		return NULL;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*shm)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	return shm == MAP_FAILED ? NULL : shm;
+}
+
+// Copy a consistent snapshot of the region. Returns false if the layout
+// is not the one this reader was built for, or if no consistent copy
+// could be taken.
+bool
+openbar_shm_read(const struct OpenbarShm *shm, struct OpenbarShm *copy)
+{
+	uint32_t seq;
+	int i;
+
+	for (i = 0; i < SHM_READ_TRIES; i++) {
+		seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(copy, shm, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		return copy->magic == OPENBAR_SHM_MAGIC &&
+		    copy->version == OPENBAR_SHM_VERSION;
+	}
+	return false;
+}
+
+// Unmap a region mapped by openbar_shm_attach()
+void
+openbar_shm_detach(const struct OpenbarShm *shm)
+{
+	munmap((void *)shm, sizeof(*shm));
+}
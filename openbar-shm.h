@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2024 Gonzalo Rodriguez <gonzalo@x61.sh>
+ * Copyright (c) 2024-2026 David David Uhden Collado <david@uhden.dev>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef OPENBAR_SHM_H
+#define OPENBAR_SHM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Layout version of the shared snapshot. It changes whenever a field is
+// added, removed or resized; readers refuse any other version.
+#define OPENBAR_SHM_VERSION 4
+#define OPENBAR_SHM_MAGIC 0x4f424152 // "OBAR"
+#define OPENBAR_SHM_CORES 256
+
+// Bits of the sampled mask. The daemon only samples the modules its
+// format references; a bit is set once the values it covers were
+// published, and the fields of a clear bit are zero and mean nothing.
+// The public addresses read "N/A" until they are fetched.
+#define OPENBAR_SHM_HOSTNAME 0x0001
+#define OPENBAR_SHM_DATE 0x0002
+#define OPENBAR_SHM_CPU 0x0004 // cpu_speed and cpu_temp
+#define OPENBAR_SHM_MEM 0x0008
+#define OPENBAR_SHM_LOAD 0x0010
+#define OPENBAR_SHM_BAT 0x0020
+#define OPENBAR_SHM_VPN 0x0040
+#define OPENBAR_SHM_LAN 0x0080
+#define OPENBAR_SHM_USAGE 0x0100 // usage_* and cores
+#define OPENBAR_SHM_TRAFFIC 0x0200 // rx_rate and tx_rate
+#define OPENBAR_SHM_AC 0x0400
+#define OPENBAR_SHM_BAT_TIME 0x0800
+
+// The OpenbarShm structure is the fixed layout of the shared memory
+// region published by "openbar -o shm". seq is a seqlock counter, odd
+// while the daemon writes the region: a reader copies the region and
+// retries if seq was odd or changed meanwhile, so reads take no lock
+// and no system call. updated is the wall-clock time of the last
+// publish, in seconds, pid the process that publishes, and sampled the
+// OPENBAR_SHM_* bits of the values published so far. Text fields
+// are NUL-terminated and hold what the bar would show.
+struct OpenbarShm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t seq;
+	int64_t updated;
+	int64_t pid;
+	uint32_t sampled;
+	uint64_t free_memory;
+	double load[3];
+	double usage_user;
+	double usage_sys;
+	double usage_intr;
+	double usage_idle;
+	double rx_rate;
+	double tx_rate;
+	char hostname[256];
+	char date[32];
+	char cpu_speed[32];
+	char cpu_temp[32];
+	char battery[32];
+	char ac[8];
+	char bat_time[16];
+	char vpn[16];
+	char lan[16];
+	char public_ip[64];
+	char public_ipv6[48];
+	char cores[OPENBAR_SHM_CORES * 3 + 1];
+};
+
+// Writer side, used by the daemon
+struct OpenbarShm *openbar_shm_create(void);
+void openbar_shm_write_begin(struct OpenbarShm *shm);
+void openbar_shm_write_end(struct OpenbarShm *shm);
+void openbar_shm_destroy(struct OpenbarShm *shm);
+
+// Reader side: map the region once, then read consistent copies of it
+// as often as needed
+const struct OpenbarShm *openbar_shm_attach(void);
+bool openbar_shm_read(const struct OpenbarShm *shm, struct OpenbarShm *copy);
+void openbar_shm_detach(const struct OpenbarShm *shm);
+
+#endif
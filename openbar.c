@@ -27,28 +27,41 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <sys/ioctl.h>
-#include <sys/sensors.h>
+#ifdef __linux__
+#define _GNU_SOURCE // BSD and POSIX interfaces hidden by -std=c99
+#endif
+
 #include <sys/socket.h>
-#include <sys/sysctl.h>
-#include <sys/time.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <net/if.h>
 #include <netinet/in.h>
 
 #include <X11/Xatom.h>
+#include <X11/Xft/Xft.h>
 #include <X11/Xlib.h>
 #include <X11/Xresource.h>
 #include <X11/Xutil.h>
+#ifdef HAVE_XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif
+#ifdef HAVE_XSS
+#include <X11/extensions/dpms.h>
+#include <X11/extensions/scrnsaver.h>
+#endif
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <ifaddrs.h>
 #include <limits.h>
 #include <locale.h>
-#include <machine/apmvar.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -56,26 +69,237 @@
 #include <unistd.h>
 #include <wchar.h>
 
+#include "openbar-shm.h"
+#include "openbar.h"
+
+#ifndef INET_ADDRSTRLEN
 #define INET_ADDRSTRLEN 16
+#endif
+#ifndef INET6_ADDRSTRLEN
 #define INET6_ADDRSTRLEN 46
+#endif
 #define MAX_IP_LENGTH 64
 #define MAX_LINE_LENGTH 256
 #define MAX_OUTPUT_LENGTH 16
 #define HOSTNAME_MAX_LENGTH 256
+#define SEGMENT_MAX_LENGTH 128
+#define FORMAT_MAX_OPS 64
+#define FORMAT_MAX_LENGTH 1024
+#define CONFIG_HASH_SIZE 64
+
+#define IFACE_MAX 64
+#define IFACE_MAX_AGE NSEC_PER_SEC
+#define IFACE_FRESH (100 * NSEC_PER_MSEC)
+
+#define BAR_HEIGHT 30
+#define BAR_BASELINE 20
+#define BAR_MAX 8
+
+
+// Modules due within SCHED_SLACK of a wakeup are sampled together with
+// it, so that nearby deadlines share a single wakeup
+#define SCHED_SLACK (250 * NSEC_PER_MSEC)
+
+// Public IP fetch timing: a whole attempt (resolve, connect, request and
+// response) must finish within PUBIP_TIMEOUT, and each address gets
+// PUBIP_CONNECT_TIMEOUT to connect. Failed attempts are retried with an
+// exponential backoff between PUBIP_BACKOFF_MIN and PUBIP_BACKOFF_MAX.
+#define PUBIP_TIMEOUT (10 * NSEC_PER_SEC)
+#define PUBIP_CONNECT_TIMEOUT (3 * NSEC_PER_SEC)
+#define PUBIP_BACKOFF_MIN (5 * NSEC_PER_SEC)
+#define PUBIP_BACKOFF_MAX (15 * 60 * NSEC_PER_SEC)
+#define PUBIP_FAMILIES 2
+
+// Wire format constants of the DNS (RFC 1035) and STUN (RFC 5389)
+// public IP resolvers
+#define DNS_HEADER_SIZE 12
+#define DNS_TYPE_A 1
+#define DNS_TYPE_TXT 16
+#define DNS_TYPE_AAAA 28
+#define STUN_HEADER_SIZE 20
+#define STUN_BINDING_REQUEST 0x0001
+#define STUN_BINDING_RESPONSE 0x0101
+#define STUN_MAGIC_COOKIE 0x2112a442
+#define STUN_MAPPED_ADDRESS 0x0001
+#define STUN_XOR_MAPPED_ADDRESS 0x0020
+
+#define STAT_BUCKETS 40
+
+#define POOL_WORKERS 2
+#define POOL_FIRST_FRAME (100 * NSEC_PER_MSEC)
+
+// The history rings are sized at build time, so that a reload never
+// reallocates them; history= only chooses how many samples are drawn
+#define HISTORY_MAX 40
+#define HISTORY_DEFAULT 20
+#define SPARK_WIDTH 3
+#define SPARK_MARGIN 4
+
+// Weight of the newest rate of charge in the battery time estimate
+#define BAT_EWMA_ALPHA 0.25
+
+// How much longer module intervals get on battery by default, and how
+// often a screen blanked by DPMS, which sends no event, is checked
+#define BATTERY_STRETCH_DEFAULT 2
+#define BATTERY_STRETCH_MAX 10
+#define BLANK_RECHECK (5 * NSEC_PER_SEC)
+
+// Smallest jump of the wall clock against the monotonic clock that moves
+// the wall-aligned deadlines; slewing by ntpd stays well below it
+#define CLOCK_STEP NSEC_PER_SEC
 
 // Declare global variables for storing system information
 static char battery_percent[32];
+static char battery_ac[8];
+static char battery_time[16];
 static char cpu_temp[32];
-static char cpu_base_speed[32];
 static char cpu_avg_speed[32];
+static char cpu_cores[CPU_MAX * 3 + 1];
 static char datetime[32];
+static char hostname[HOSTNAME_MAX_LENGTH];
 static char public_ip[MAX_IP_LENGTH];
-static char public_ipv6[INET6_ADDRSTRLEN];
+static char public_ipv6[INET6_ADDRSTRLEN + 1];
 static char internal_ip[INET_ADDRSTRLEN];
 static char vpn_status[16];
 double system_load[3];
 unsigned long long free_memory;
 
+// The CpuUsage structure holds two per-core samples of the CPU times,
+// flipped on every tick so that utilization is computed from the
+// difference without allocating. The percentages are of the time elapsed
+// since the previous sample (since boot for the first one).
+struct CpuUsage {
+	struct CpuTimes times[2][CPU_MAX];
+	int current;
+	int count;
+	double user;
+	double sys;
+	double intr;
+	double idle;
+};
+
+static struct CpuUsage cpu_usage;
+
+// The BatteryRate structure tracks how fast the battery charges or
+// discharges, in percent per second, for the time estimate. The charge
+// only moves in whole percents, so a rate is measured between two level
+// changes: since is when the level last changed, and anchored tells
+// whether that was a real change rather than the first sample or an AC
+// transition. rate is an exponentially weighted moving average, 0 until
+// the first measurement, and restarts whenever the AC state flips.
+struct BatteryRate {
+	enum power_ac ac_state;
+	int percent;
+	uint64_t since;
+	bool anchored;
+	bool sampled;
+	double rate;
+};
+
+static struct BatteryRate battery_rate;
+
+// Descriptor reporting power events (AC plug and unplug, battery level
+// changes), or -1 when the kernel offers none
+static int power_fd = -1;
+
+// Whether the machine last ran on battery, as seen by the battery module
+// or by the main loop on power events. Read with atomics, as the battery
+// module may run on a worker.
+static int on_battery;
+
+// Numeric metrics whose recent samples are kept for sparklines
+enum history_id {
+	HIST_LOAD,
+	HIST_MEM,
+	HIST_TEMP,
+	HIST_BAT,
+	HIST_USAGE,
+	HIST_RX,
+	HIST_TX,
+	HIST_COUNT
+};
+
+// The History structure is a fixed ring of the last HISTORY_MAX samples
+// of a metric; head is the next slot written. floor is the smallest
+// full-scale value of its sparkline: percentages have a fixed 0-100
+// scale, and the others grow to the largest sample shown.
+struct History {
+	double samples[HISTORY_MAX];
+	int head;
+	int count;
+	double floor;
+};
+
+static struct History history[HIST_COUNT] = {
+	[HIST_LOAD] = {.floor = 1},
+	[HIST_MEM] = {.floor = 1},
+	[HIST_TEMP] = {.floor = 100},
+	[HIST_BAT] = {.floor = 100},
+	[HIST_USAGE] = {.floor = 100},
+	[HIST_RX] = {.floor = 1},
+	[HIST_TX] = {.floor = 1},
+};
+
+// Modules sampled by the scheduler, each on its own interval
+enum module_id {
+	MOD_HOSTNAME,
+	MOD_DATE,
+	MOD_CPU,
+	MOD_MEM,
+	MOD_LOAD,
+	MOD_BAT,
+	MOD_VPN,
+	MOD_NET,
+	MOD_USAGE,
+	MOD_TRAFFIC,
+	MOD_COUNT
+};
+
+// The ModuleInfo structure describes a module: its configuration name,
+// its default refresh interval in seconds, and whether its deadlines are
+// aligned to wall-clock multiples of the interval (so that the clock
+// wakes exactly on minute boundaries).
+struct ModuleInfo {
+	const char *name;
+	unsigned int interval;
+	bool wall_aligned;
+};
+
+static const struct ModuleInfo module_info[MOD_COUNT] = {
+	[MOD_HOSTNAME] = {"hostname", 3600, false},
+	[MOD_DATE] = {"date", 60, true},
+	[MOD_CPU] = {"cpu", 5, false},
+	[MOD_MEM] = {"mem", 10, false},
+	[MOD_LOAD] = {"load", 15, false},
+	[MOD_BAT] = {"bat", 30, false},
+	[MOD_VPN] = {"vpn", 30, false},
+	[MOD_NET] = {"net", 30, false},
+	[MOD_USAGE] = {"usage", 5, false},
+	[MOD_TRAFFIC] = {"traffic", 2, false},
+};
+
+// Sequence counters of the seqlocks that publish the values of each
+// module to the renderer: odd while a collector writes them. Collectors
+// do their slow work first and only copy the results inside the write
+// section, so the renderer never waits on a collector.
+static unsigned int module_seq[MOD_COUNT];
+
+// Ways of finding the public IP addresses: an HTTP service answering
+// GET /ip, a DNS server answering a query for the address it sees (an
+// A or AAAA record, or a TXT record), or a STUN server. Each of the UDP
+// resolvers costs a single datagram each way.
+enum pubip_method {
+	PUBIP_HTTP,
+	PUBIP_DNS,
+	PUBIP_DNS_TXT,
+	PUBIP_STUN,
+	PUBIP_METHOD_COUNT
+};
+
+static const char *pubip_method_names[PUBIP_METHOD_COUNT] = {
+	"http", "dns", "dns-txt", "stun"
+};
+
 // Define configuration structure
 // The Config structure holds configuration options for the application.
 // It includes options for displaying various system information such as
@@ -87,6 +311,10 @@ struct Config {
 	char *font;
 	char *foreground;
 	char *background;
+	char *public_ip_host;
+	char *public_ip_port;
+	char *sensor;
+	char *format;
 	int show_hostname;
 	int show_date;
 	int show_cpu;
@@ -95,38 +323,463 @@ struct Config {
 	int show_load;
 	int show_net;
 	int show_vpn;
+	int show_usage;
+	int show_traffic;
+	bool public_ip;
+	unsigned int interval[MOD_COUNT];
+	unsigned int public_ip_interval;
+	int public_ip_resolver;
+	unsigned int history;
+	unsigned int battery_stretch;
 };
 
-// Extract logo from configuration line
-char *
-extract_logo(const char *line)
-{
-	if (strstr(line, "logo=")) {
-		const char *logo_start = strchr(line, '=') + 1;
-		const char *logo_end = NULL;
+// Keys of the configuration file. Every module has a "<module>=yes|no"
+// key at KEY_SHOW + id and a "<module>_interval=seconds" key at
+// KEY_INTERVAL + id.
+enum config_key {
+	KEY_SHOW,
+	KEY_INTERVAL = KEY_SHOW + MOD_COUNT,
+	KEY_LOGO = KEY_INTERVAL + MOD_COUNT,
+	KEY_INTERFACE,
+	KEY_SENSOR,
+	KEY_FORMAT,
+	KEY_PUBLIC_IP_HOST,
+	KEY_PUBLIC_IP_PORT,
+	KEY_PUBLIC_IP_INTERVAL,
+	KEY_HISTORY,
+	KEY_BATTERY_STRETCH,
+	KEY_PUBLIC_IP_RESOLVER
+};
 
-		// Find the end of the logo string
-		const char *cursor = logo_start;
-		while (*cursor && *cursor != ' ' && *cursor != '\n') {
-			cursor++;
-		}
-		logo_end = cursor;
+struct ConfigKey {
+	const char *name;
+	int key;
+};
 
-		// Calculate the length of the logo string
-		size_t logo_length = logo_end - logo_start;
+// Perfect hash table of the configuration keys, indexed by
+// config_hash()
+static const struct ConfigKey config_keys[CONFIG_HASH_SIZE] = {
+	[0] = {"vpn_interval", KEY_INTERVAL + MOD_VPN},
+	[1] = {"interface", KEY_INTERFACE},
+	[3] = {"mem", KEY_SHOW + MOD_MEM},
+	[4] = {"date", KEY_SHOW + MOD_DATE},
+	[6] = {"public_ip_port", KEY_PUBLIC_IP_PORT},
+	[7] = {"net", KEY_SHOW + MOD_NET},
+	[13] = {"hostname_interval", KEY_INTERVAL + MOD_HOSTNAME},
+	[15] = {"cpu", KEY_SHOW + MOD_CPU},
+	[16] = {"load", KEY_SHOW + MOD_LOAD},
+	[19] = {"traffic", KEY_SHOW + MOD_TRAFFIC},
+	[20] = {"hostname", KEY_SHOW + MOD_HOSTNAME},
+	[25] = {"load_interval", KEY_INTERVAL + MOD_LOAD},
+	[27] = {"vpn", KEY_SHOW + MOD_VPN},
+	[28] = {"mem_interval", KEY_INTERVAL + MOD_MEM},
+	[29] = {"usage", KEY_SHOW + MOD_USAGE},
+	[30] = {"public_ip_resolver", KEY_PUBLIC_IP_RESOLVER},
+	[31] = {"history", KEY_HISTORY},
+	[32] = {"net_interval", KEY_INTERVAL + MOD_NET},
+	[34] = {"public_ip_host", KEY_PUBLIC_IP_HOST},
+	[39] = {"bat", KEY_SHOW + MOD_BAT},
+	[43] = {"battery_stretch", KEY_BATTERY_STRETCH},
+	[46] = {"public_ip_interval", KEY_PUBLIC_IP_INTERVAL},
+	[48] = {"bat_interval", KEY_INTERVAL + MOD_BAT},
+	[52] = {"cpu_interval", KEY_INTERVAL + MOD_CPU},
+	[54] = {"sensor", KEY_SENSOR},
+	[56] = {"logo", KEY_LOGO},
+	[57] = {"date_interval", KEY_INTERVAL + MOD_DATE},
+	[58] = {"format", KEY_FORMAT},
+	[60] = {"traffic_interval", KEY_INTERVAL + MOD_TRAFFIC},
+	[62] = {"usage_interval", KEY_INTERVAL + MOD_USAGE},
+};
 
-		// Allocate memory for the logo and copy it
-		char *logo = (char *)malloc((logo_length + 1) * sizeof(char));
-		if (logo == NULL) {
-			perror("Failed to allocate memory for logo");
-			exit(EXIT_FAILURE);
-		}
-		strncpy(logo, logo_start, logo_length);
-		logo[logo_length] = '\0';
-		return logo;
-	}
-	return NULL;
-}
+// Fields a format template can reference
+enum format_field {
+	FIELD_LOGO,
+	FIELD_HOSTNAME,
+	FIELD_DATE,
+	FIELD_CPU,
+	FIELD_TEMP,
+	FIELD_MEM,
+	FIELD_LOAD,
+	FIELD_LOAD5,
+	FIELD_LOAD15,
+	FIELD_BAT,
+	FIELD_AC,
+	FIELD_BAT_TIME,
+	FIELD_VPN,
+	FIELD_IP,
+	FIELD_IPV6,
+	FIELD_LAN,
+	FIELD_RX,
+	FIELD_TX,
+	FIELD_USAGE,
+	FIELD_USAGE_USER,
+	FIELD_USAGE_SYS,
+	FIELD_USAGE_INTR,
+	FIELD_USAGE_IDLE,
+	FIELD_CORES,
+	FIELD_LOAD_GRAPH,
+	FIELD_MEM_GRAPH,
+	FIELD_TEMP_GRAPH,
+	FIELD_BAT_GRAPH,
+	FIELD_USAGE_GRAPH,
+	FIELD_RX_GRAPH,
+	FIELD_TX_GRAPH,
+	FIELD_COUNT
+};
+
+// The FieldInfo structure maps a format field name to the module that
+// samples it (-1 for none) and to the default precision of numeric
+// fields (-1 for text fields, where a precision truncates instead).
+struct FieldInfo {
+	const char *name;
+	int module;
+	int precision;
+};
+
+static const struct FieldInfo field_info[FIELD_COUNT] = {
+	[FIELD_LOGO] = {"logo", -1, -1},
+	[FIELD_HOSTNAME] = {"hostname", MOD_HOSTNAME, -1},
+	[FIELD_DATE] = {"date", MOD_DATE, -1},
+	[FIELD_CPU] = {"cpu", MOD_CPU, -1},
+	[FIELD_TEMP] = {"temp", MOD_CPU, -1},
+	[FIELD_MEM] = {"mem", MOD_MEM, 0},
+	[FIELD_LOAD] = {"load", MOD_LOAD, 2},
+	[FIELD_LOAD5] = {"load5", MOD_LOAD, 2},
+	[FIELD_LOAD15] = {"load15", MOD_LOAD, 2},
+	[FIELD_BAT] = {"bat", MOD_BAT, -1},
+	[FIELD_AC] = {"ac", MOD_BAT, -1},
+	[FIELD_BAT_TIME] = {"bat_time", MOD_BAT, -1},
+	[FIELD_VPN] = {"vpn", MOD_VPN, -1},
+	[FIELD_IP] = {"ip", MOD_NET, -1},
+	[FIELD_IPV6] = {"ipv6", MOD_NET, -1},
+	[FIELD_LAN] = {"lan", MOD_NET, -1},
+	[FIELD_RX] = {"rx", MOD_TRAFFIC, -1},
+	[FIELD_TX] = {"tx", MOD_TRAFFIC, -1},
+	[FIELD_USAGE] = {"usage", MOD_USAGE, 0},
+	[FIELD_USAGE_USER] = {"usage_user", MOD_USAGE, 0},
+	[FIELD_USAGE_SYS] = {"usage_sys", MOD_USAGE, 0},
+	[FIELD_USAGE_INTR] = {"usage_intr", MOD_USAGE, 0},
+	[FIELD_USAGE_IDLE] = {"usage_idle", MOD_USAGE, 0},
+	[FIELD_CORES] = {"cores", MOD_USAGE, -1},
+	[FIELD_LOAD_GRAPH] = {"load_graph", MOD_LOAD, -1},
+	[FIELD_MEM_GRAPH] = {"mem_graph", MOD_MEM, -1},
+	[FIELD_TEMP_GRAPH] = {"temp_graph", MOD_CPU, -1},
+	[FIELD_BAT_GRAPH] = {"bat_graph", MOD_BAT, -1},
+	[FIELD_USAGE_GRAPH] = {"usage_graph", MOD_USAGE, -1},
+	[FIELD_RX_GRAPH] = {"rx_graph", MOD_TRAFFIC, -1},
+	[FIELD_TX_GRAPH] = {"tx_graph", MOD_TRAFFIC, -1},
+};
+
+// One operation of a compiled format template: either a literal run of
+// text or a field reference with an optional minimum width (left
+// aligned when left is set) and precision.
+struct FormatOp {
+	bool literal;
+	int field;
+	int width;
+	int precision;
+	bool left;
+	const char *text;
+	size_t length;
+};
+
+// The Format structure is a format template compiled at config-load
+// time into a flat list of operations. Literal text is kept in the
+// structure itself, so rendering a frame never allocates.
+struct Format {
+	struct FormatOp ops[FORMAT_MAX_OPS];
+	int count;
+	char literals[FORMAT_MAX_LENGTH];
+	size_t literals_used;
+};
+
+// The Segment structure caches the rendered text of one format
+// operation, so that only segments whose text changed are measured and
+// repainted. It is shared by all bars. The text of a graph segment is a
+// sparkline of block characters, which bars draw as rectangles.
+struct Segment {
+	char text[SEGMENT_MAX_LENGTH];
+	size_t length;
+	bool dirty;
+	bool graph;
+};
+
+// The SegmentLayout structure holds the pixel width and x-offset of a
+// segment on one bar. painted_width is the width of the text currently
+// on screen.
+struct SegmentLayout {
+	int width;
+	int painted_width;
+	int x;
+};
+
+// The Output structure is the geometry of one monitor; id is its RandR
+// output, or None for the whole screen
+struct Output {
+	unsigned long id;
+	int x;
+	int y;
+	int width;
+};
+
+// The IfaceEntry structure holds the state of one network interface in
+// the interface snapshot: its flags, its first IPv4 address and its
+// cumulative byte counters, with their width in bits.
+struct IfaceEntry {
+	char name[IFNAMSIZ];
+	unsigned int flags;
+	bool has_inet;
+	struct in_addr inet;
+	bool has_bytes;
+	unsigned int bits;
+	uint64_t rx;
+	uint64_t tx;
+};
+
+// The IfaceCache structure is the interface snapshot shared by the VPN,
+// network and traffic modules. The VPN and network modules only refresh
+// it when the routing socket reports an interface or address change;
+// the traffic module refreshes it on every sample, for the counters.
+struct IfaceCache {
+	struct IfaceEntry entries[IFACE_MAX];
+	int count;
+	int route_fd;
+	bool stale;
+	uint64_t taken;
+};
+
+static struct IfaceCache iface_cache = {.route_fd = -1, .stale = true};
+
+// The TrafficCounter structure holds the byte counters of one interface
+// at the previous sample of the traffic module
+struct TrafficCounter {
+	char name[IFNAMSIZ];
+	uint64_t rx;
+	uint64_t tx;
+};
+
+// The Traffic structure holds the state of the traffic module: two
+// samples of the counters of the interfaces it measures, flipped on
+// every sample like those of CpuUsage, the time of the snapshot the
+// current one was taken from, and the receive and transmit rates in
+// bytes per second computed from their differences.
+struct Traffic {
+	struct TrafficCounter counters[2][IFACE_MAX];
+	int count[2];
+	int current;
+	uint64_t taken;
+	double rx_rate;
+	double tx_rate;
+};
+
+static struct Traffic traffic;
+
+static struct SensorCache sensor_cache = {.selected = -1};
+
+// The Bar structure holds the X resources of the status bar window. The
+// font and the window width are cached client-side so that a steady
+// state frame needs no round trip to the server. Frames are rendered
+// into the buffer Pixmap and presented to the window with XCopyArea.
+// Text is drawn with the core font, or with xft when the font is a
+// fontconfig pattern; XRender then keeps the glyphs on the server, so
+// a frame only sends glyph indices. baseline is the y of the text.
+struct Bar {
+	Display *display;
+	Window window;
+	Pixmap buffer;
+	GC gc;
+	GC clear_gc;
+	XFontStruct *font;
+	XftFont *xft;
+	XftDraw *draw;
+	XftColor xft_color;
+	bool has_xft_color;
+	int baseline;
+	int width;
+	int height;
+	unsigned long output;
+	bool obscured;
+	struct SegmentLayout layout[FORMAT_MAX_OPS];
+};
+
+// The Bars structure holds one bar per active RandR output, or a single
+// bar spanning the screen without RandR. All bars show the same
+// segments, rendered from a single sampling pass. randr_event is the
+// first RandR event code, or -1. saver_event is the first event code of
+// the MIT-SCREEN-SAVER extension, or -1; saver_on and dpms_off tell
+// whether the screen saver runs and whether DPMS turned the monitors off,
+// as last asked at dpms_checked on the monotonic clock.
+struct Bars {
+	Display *display;
+	struct Bar bar[BAR_MAX];
+	int count;
+	int randr_event;
+	int saver_event;
+	bool saver_on;
+	bool dpms;
+	bool dpms_off;
+	uint64_t dpms_checked;
+};
+
+// The Scheduler structure is a binary min-heap of the enabled modules
+// keyed by their next deadline on the monotonic clock. stretch
+// multiplies the intervals of the modules not aligned to the wall clock,
+// and is above 1 on battery. wall_offset is the offset of the wall clock
+// from the monotonic clock when it was last compared, to notice steps.
+struct Scheduler {
+	uint64_t interval[MOD_COUNT];
+	uint64_t deadline[MOD_COUNT];
+	int heap[MOD_COUNT];
+	int count;
+	unsigned int stretch;
+	int64_t wall_offset;
+};
+
+// Where the status line goes: an X11 window, a stream on stdout of
+// plain text lines or i3bar protocol JSON, or the values of every module
+// in a shared memory region for other programs to read
+enum output_mode {
+	OUTPUT_X11,
+	OUTPUT_TEXT,
+	OUTPUT_I3BAR,
+	OUTPUT_SHM
+};
+
+// The shared region written in OUTPUT_SHM mode
+static struct OpenbarShm *shm_region;
+
+// Timed code paths besides the modules. Stats are indexed by module id
+// first, then by these.
+enum stat_id {
+	STAT_FORMAT = MOD_COUNT,
+	STAT_RENDER,
+	STAT_PUBIP,
+	STAT_JITTER,
+	STAT_COUNT
+};
+
+static const char *stat_names[STAT_COUNT - MOD_COUNT] = {
+	"format", "render", "pubip", "jitter"
+};
+
+// The Stat structure accumulates the durations of one code path. Bucket
+// i of the histogram counts durations in [2^i, 2^(i+1)) nanoseconds.
+struct Stat {
+	uint64_t count;
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+	uint64_t histogram[STAT_BUCKETS];
+};
+
+static struct Stat stats[STAT_COUNT];
+static volatile sig_atomic_t stats_requested;
+static volatile sig_atomic_t quit_requested;
+static volatile sig_atomic_t reload_requested;
+
+// Self-pipe written by the signal handlers, so that a signal caught
+// after the main loop checked the flags above still wakes its poll(2)
+static int signal_pipe[2] = {-1, -1};
+
+// The public IP cache file and its directory, or empty strings when
+// there is nowhere to keep it
+static char pubip_cache_dir[PATH_MAX];
+static char pubip_cache_path[PATH_MAX];
+
+// States of a non-blocking public IP fetch
+enum pubip_state {
+	PUBIP_IDLE,
+	PUBIP_RESOLVING,
+	PUBIP_CONNECTING,
+	PUBIP_SENDING,
+	PUBIP_RECEIVING
+};
+
+// The PubipFetch structure tracks one in-flight request for the public
+// address of a single address family, over HTTP or a single UDP
+// datagram. It is driven from the main loop by pubip_step() and never
+// blocks: name resolution goes through the asynchronous resolver of the
+// platform backend, and the socket is connected and read in
+// non-blocking mode. txid is the transaction ID of a DNS or STUN
+// request, which its response must echo.
+struct PubipFetch {
+	int family;
+	enum pubip_method method;
+	enum pubip_state state;
+	const char *host;
+	const char *port;
+	char *value;
+	size_t value_size;
+	struct ResolveQuery *query;
+	struct addrinfo *res;
+	struct addrinfo *ai;
+	int fd_resolve;
+	int fd;
+	short events;
+	uint64_t wake;
+	uint64_t deadline;
+	uint64_t next_start;
+	uint64_t refresh;
+	unsigned int failures;
+	bool updated;
+	time_t fetched;
+	bool cache_dirty;
+	unsigned char txid[12];
+	char request[MAX_LINE_LENGTH];
+	size_t request_len;
+	size_t sent;
+	char buffer[1024];
+	size_t received;
+};
+
+// The PubipMethod structure describes a public IP resolver: its default
+// server, the socket type it talks over, the DNS name and record type it
+// queries (0 for the A or AAAA record of the address family), and how
+// its request is built and the address read from its response.
+struct PubipMethod {
+	const char *host;
+	const char *port;
+	int socktype;
+	const char *query;
+	uint16_t qtype;
+	bool (*encode)(struct PubipFetch *fetch,
+	    const struct PubipMethod *method);
+	bool (*decode)(const struct PubipFetch *fetch,
+	    const struct PubipMethod *method, char *ip, size_t size);
+};
+
+// The Pool structure is the set of worker threads that run the module
+// collectors off the main thread. Due modules are queued by id, and a
+// module that is still queued or running is not queued again, so a
+// collector that blocks only delays its own samples. Workers write a
+// byte to notify[1] after each job to wake the main loop, which then
+// renders the published values.
+struct Pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t idle;
+	pthread_t threads[POOL_WORKERS];
+	int started;
+	int queue[MOD_COUNT];
+	int head;
+	int count;
+	int running;
+	bool pending[MOD_COUNT];
+	bool stop;
+	int notify[2];
+	const struct Config *config;
+};
+
+static struct Pool pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+	.notify = {-1, -1},
+};
+
+// Serializes the interface snapshot between the VPN and network
+// collectors, which may run on different workers
+static pthread_mutex_t iface_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // Free memory allocated for Config structure
 void
@@ -152,9 +805,25 @@ free_config(struct Config *config)
 		free(config->background);
 		config->background = NULL;
 	}
+	if (config->public_ip_host != NULL) {
+		free(config->public_ip_host);
+		config->public_ip_host = NULL;
+	}
+	if (config->public_ip_port != NULL) {
+		free(config->public_ip_port);
+		config->public_ip_port = NULL;
+	}
+	if (config->sensor != NULL) {
+		free(config->sensor);
+		config->sensor = NULL;
+	}
+	if (config->format != NULL) {
+		free(config->format);
+		config->format = NULL;
+	}
 }
 
-// Read configuration file and populate the Config structure
+// Return the path of the configuration file to read
 static char *
 resolve_config_path(const char *override_path)
 {
@@ -179,93 +848,351 @@ resolve_config_path(const char *override_path)
 	return strdup("/etc/openbar.conf");
 }
 
-struct Config
-config_file(const char *config_file_path)
-{
-	struct Config config = {.logo = NULL,
-		.interface = NULL,
-		.font = NULL,
-		.foreground = NULL,
-		.background = NULL,
-		.show_hostname = 0,
-		.show_date = 0,
-		.show_cpu = 0,
-		.show_mem = 0,
-		.show_bat = 0,
-		.show_load = 0,
-		.show_net = 0,
-		.show_vpn = 0};
-
-	config.font = strdup("fixed");
-	config.foreground = strdup("black");
-	config.background = strdup("white");
-	if (config.font == NULL || config.foreground == NULL ||
-	    config.background == NULL) {
-		perror("Failed to allocate memory for defaults");
+// Find the public IP cache, $XDG_CACHE_HOME/openbar/pubip or
+// ~/.cache/openbar/pubip, and create its directory if needed. The paths
+// are left empty when there is no home directory or it cannot be made.
+static void
+resolve_cache_path(void)
+{
+	char base[PATH_MAX];
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	int length;
+
+	// Relative XDG paths are invalid and must be ignored
+	if (xdg != NULL && xdg[0] == '/')
+		length = snprintf(base, sizeof(base), "%s", xdg);
+	else if (home != NULL && home[0] != '\0')
+		length = snprintf(base, sizeof(base), "%s/.cache", home);
+	else
+		return;
+	// Leave room for the ".tmp" suffix of the file being rewritten
+	if (length < 0 || (size_t)length + sizeof("/openbar/pubip.tmp") >
+	    sizeof(pubip_cache_path))
+		return;
+	length = snprintf(pubip_cache_dir, sizeof(pubip_cache_dir),
+	    "%s/openbar", base);
+	if (length < 0 || (size_t)length >= sizeof(pubip_cache_dir)) {
+		pubip_cache_dir[0] = '\0';
+		return;
+	}
+	if ((mkdir(base, 0700) == -1 && errno != EEXIST) ||
+	    (mkdir(pubip_cache_dir, 0700) == -1 && errno != EEXIST)) {
+		perror(pubip_cache_dir);
+		pubip_cache_dir[0] = '\0';
+		return;
+	}
+	length = snprintf(pubip_cache_path, sizeof(pubip_cache_path),
+	    "%s/pubip", pubip_cache_dir);
+	if (length < 0 || (size_t)length >= sizeof(pubip_cache_path))
+		pubip_cache_path[0] = '\0';
+}
+
+// Set the enable flag of a module
+static void
+module_enable(struct Config *config, int id, int enabled)
+{
+	switch (id) {
+	case MOD_HOSTNAME:
+		config->show_hostname = enabled;
+		break;
+	case MOD_DATE:
+		config->show_date = enabled;
+		break;
+	case MOD_CPU:
+		config->show_cpu = enabled;
+		break;
+	case MOD_MEM:
+		config->show_mem = enabled;
+		break;
+	case MOD_LOAD:
+		config->show_load = enabled;
+		break;
+	case MOD_BAT:
+		config->show_bat = enabled;
+		break;
+	case MOD_VPN:
+		config->show_vpn = enabled;
+		break;
+	case MOD_NET:
+		config->show_net = enabled;
+		break;
+	case MOD_USAGE:
+		config->show_usage = enabled;
+		break;
+	case MOD_TRAFFIC:
+		config->show_traffic = enabled;
+		break;
+	}
+}
+
+// Replace *dest with a copy of value
+static void
+config_string(char **dest, const char *value)
+{
+	char *copy = strdup(value);
+
+	if (copy == NULL) {
+		perror("Failed to allocate memory for config value");
 		exit(EXIT_FAILURE);
 	}
+	free(*dest);
+	*dest = copy;
+}
+
+// Hash a key for config_keys. The multipliers were picked so that no
+// two keys collide; check the table again when adding a key.
+static unsigned int
+config_hash(const char *key, size_t length)
+{
+	return (length + 4 * (unsigned char)key[0] +
+	    28 * (unsigned char)key[length - 2]) % CONFIG_HASH_SIZE;
+}
+
+// Return the config_key of a key name, or -1 if it is unknown. A single
+// hash probe and one string compare, whatever the number of keys.
+static int
+config_lookup(const char *key)
+{
+	size_t length = strlen(key);
+	const struct ConfigKey *entry;
+
+	if (length < 3)
+		return -1;
+	entry = &config_keys[config_hash(key, length)];
+	if (entry->name == NULL || strcmp(entry->name, key) != 0)
+		return -1;
+	return entry->key;
+}
+
+// Split a configuration line into a key and a value, in place. Blank
+// lines and lines starting with '#' are skipped, as is anything after
+// a '#' that follows whitespace. A value may be double-quoted to keep
+// leading or trailing blanks and " #"; inside quotes, \" and \\ stand
+// for a quote and a backslash. Returns 1 for a key=value line, 0 for a
+// line without one, or -1 with *error set on a syntax error.
+static int
+config_tokenize(char *line, char **key, char **value, const char **error)
+{
+	char *p = line, *key_end, *out;
+
+	p += strspn(p, " \t\r\n");
+	if (*p == '\0' || *p == '#')
+		return 0;
+
+	*key = p;
+	while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+	    (*p >= '0' && *p <= '9') || *p == '_')
+		p++;
+	key_end = p;
+	if (key_end == *key) {
+		*error = "expected a key";
+		return -1;
+	}
+	p += strspn(p, " \t");
+	if (*p != '=') {
+		*error = "expected '=' after the key";
+		return -1;
+	}
+	*key_end = '\0';
+	p++;
+	p += strspn(p, " \t");
+
+	if (*p == '"') {
+		*value = out = ++p;
+		for (;;) {
+			if (*p == '\0' || *p == '\n') {
+				*error = "unterminated quoted value";
+				return -1;
+			}
+			if (*p == '"')
+				break;
+			if (*p == '\\' && (p[1] == '"' || p[1] == '\\'))
+				p++;
+			*out++ = *p++;
+		}
+		*out = '\0';
+		p++;
+		p += strspn(p, " \t\r\n");
+		if (*p != '\0' && *p != '#') {
+			*error = "unexpected text after the quoted value";
+			return -1;
+		}
+		return 1;
+	}
+
+	*value = p;
+	for (; *p != '\0'; p++) {
+		if (*p == '#' && p > line && (p[-1] == ' ' || p[-1] == '\t'))
+			break;
+	}
+	while (p > *value &&
+	    (p[-1] == ' ' || p[-1] == '\t' || p[-1] == '\r' || p[-1] == '\n'))
+		p--;
+	*p = '\0';
+	return 1;
+}
+
+// Apply one key=value pair to the Config structure. Returns NULL, or a
+// description of what is wrong with the value.
+static const char *
+config_apply(struct Config *config, const char *key, const char *value)
+{
+	unsigned long seconds;
+	char *end;
+	int id = config_lookup(key), i;
+
+	if (id == -1)
+		return "unknown key";
+
+	if (id >= KEY_SHOW && id < KEY_SHOW + MOD_COUNT) {
+		if (strcmp(value, "yes") == 0)
+			module_enable(config, id - KEY_SHOW, 1);
+		else if (strcmp(value, "no") == 0)
+			module_enable(config, id - KEY_SHOW, 0);
+		else
+			return "expected yes or no";
+		return NULL;
+	}
+
+	if ((id >= KEY_INTERVAL && id < KEY_INTERVAL + MOD_COUNT) ||
+	    id == KEY_PUBLIC_IP_INTERVAL) {
+		seconds = strtoul(value, &end, 10);
+		if (end == value || *end != '\0' || seconds == 0 ||
+		    seconds > 86400)
+			return "expected an interval from 1 to 86400 seconds";
+		if (id == KEY_PUBLIC_IP_INTERVAL)
+			config->public_ip_interval = seconds;
+		else
+			config->interval[id - KEY_INTERVAL] = seconds;
+		return NULL;
+	}
+
+	switch (id) {
+	case KEY_HISTORY:
+		// No more samples than the fixed rings of HISTORY_MAX hold
+		seconds = strtoul(value, &end, 10);
+		if (end == value || *end != '\0' || seconds == 0 ||
+		    seconds > HISTORY_MAX)
+			return "expected a number of samples from 1 to 40";
+		config->history = seconds;
+		break;
+	case KEY_BATTERY_STRETCH:
+		seconds = strtoul(value, &end, 10);
+		if (end == value || *end != '\0' || seconds == 0 ||
+		    seconds > BATTERY_STRETCH_MAX)
+			return "expected a factor from 1 to 10";
+		config->battery_stretch = seconds;
+		break;
+	case KEY_LOGO:
+		config_string(&config->logo, value);
+		break;
+	case KEY_INTERFACE:
+		config_string(&config->interface, value);
+		break;
+	case KEY_SENSOR:
+		config_string(&config->sensor, value);
+		break;
+	case KEY_FORMAT:
+		config_string(&config->format, value);
+		break;
+	case KEY_PUBLIC_IP_HOST:
+		config_string(&config->public_ip_host, value);
+		break;
+	case KEY_PUBLIC_IP_PORT:
+		config_string(&config->public_ip_port, value);
+		break;
+	case KEY_PUBLIC_IP_RESOLVER:
+		for (i = 0; i < PUBIP_METHOD_COUNT; i++) {
+			if (strcmp(value, pubip_method_names[i]) == 0)
+				break;
+		}
+		if (i == PUBIP_METHOD_COUNT)
+			return "expected http, dns, dns-txt or stun";
+		config->public_ip_resolver = i;
+		break;
+	}
+	return NULL;
+}
+
+// Return whether two optional config strings differ
+static bool
+config_changed(const char *old, const char *value)
+{
+	if (old == NULL || value == NULL)
+		return old != value;
+	return strcmp(old, value) != 0;
+}
 
-	FILE *file = fopen(config_file_path, "r");
+// Read the configuration file into the Config structure. Unknown keys
+// are reported and skipped. Returns false, with the error reported and
+// the structure freed, if the file cannot be read or a line is invalid.
+static bool
+config_file(const char *config_file_path, struct Config *config)
+{
+	char line[FORMAT_MAX_LENGTH + MAX_LINE_LENGTH];
+	char *key, *value;
+	const char *error;
+	int number = 0;
+	FILE *file;
+
+	memset(config, 0, sizeof(*config));
+	for (int i = 0; i < MOD_COUNT; i++)
+		config->interval[i] = module_info[i].interval;
+	config->public_ip_interval = 300;
+	config->history = HISTORY_DEFAULT;
+	config->battery_stretch = BATTERY_STRETCH_DEFAULT;
+	config_string(&config->font, "fixed");
+	config_string(&config->foreground, "black");
+	config_string(&config->background, "white");
+
+	file = fopen(config_file_path, "r");
 	if (file == NULL) {
 		fprintf(stderr, "Error: Unable to open config file at %s\n",
 		    config_file_path);
-		exit(EXIT_FAILURE);
+		free_config(config);
+		return false;
 	}
 
-	char line[MAX_LINE_LENGTH];
-
 	while (fgets(line, sizeof(line), file)) {
-		line[strcspn(line, "\n")] = '\0';
-
-		char *logo = extract_logo(line);
-		if (logo != NULL) {
-			if (config.logo != NULL) {
-				free(config.logo); // Free previously allocated
-				                   // memory
-			}
-			config.logo = logo;
-			continue; // Move to the next line
-		}
-		// Extract interface option
-		if (strstr(line, "interface=")) {
-			const char *interface_start = strchr(line, '=') + 1;
-			size_t interface_length = strlen(interface_start);
-			if (config.interface != NULL) {
-				free(config.interface); // Free previously
-				                        // allocated memory
-			}
-			config.interface = malloc(interface_length + 1);
-			if (config.interface == NULL) {
-				perror(
-				    "Failed to allocate memory for interface");
-				exit(EXIT_FAILURE);
-			}
-			strncpy(config.interface, interface_start,
-			    interface_length);
-			config.interface[interface_length] = '\0';
-		}
-		// Check configuration options
-		if (strstr(line, "date=yes")) {
-			config.show_date = 1;
-		} else if (strstr(line, "cpu=yes")) {
-			config.show_cpu = 1;
-		} else if (strstr(line, "load=yes")) {
-			config.show_load = 1;
-		} else if (strstr(line, "bat=yes")) {
-			config.show_bat = 1;
-		} else if (strstr(line, "net=yes")) {
-			config.show_net = 1;
-		} else if (strstr(line, "mem=yes")) {
-			config.show_mem = 1;
-		} else if (strstr(line, "hostname=yes")) {
-			config.show_hostname = 1;
-		} else if (strstr(line, "vpn=yes")) {
-			config.show_vpn = 1;
+		number++;
+		if (strchr(line, '\n') == NULL && !feof(file)) {
+			error = "line too long";
+			goto bad;
 		}
+		switch (config_tokenize(line, &key, &value, &error)) {
+		case -1:
+			goto bad;
+		case 0:
+			continue;
+		}
+		if ((error = config_apply(config, key, value)) == NULL)
+			continue;
+		if (config_lookup(key) == -1) {
+			fprintf(stderr, "%s:%d: unknown key %s, ignored\n",
+			    config_file_path, number, key);
+			continue;
+		}
+		fprintf(stderr, "%s:%d: %s: %s\n", config_file_path, number,
+		    key, error);
+		goto fail;
+	}
+	fclose(file);
+
+	if (config->logo == NULL) {
+		fprintf(stderr,
+		    "Error: Unable to read logo from config file\n");
+		free_config(config);
+		return false;
 	}
+	return true;
 
+bad:
+	fprintf(stderr, "%s:%d: %s\n", config_file_path, number, error);
+fail:
 	fclose(file);
-	return config;
+	free_config(config);
+	return false;
 }
 
 static void
@@ -285,20 +1212,29 @@ set_config_string(char **dest, const char *value)
 	*dest = dup;
 }
 
+// Apply the openbar.* entries of the X resource database. The database
+// is read from the root window rather than the copy Xlib took when the
+// display was opened, so that a reload sees changes made with xrdb(1).
 static void
 load_xresources(Display *display, struct Config *config)
 {
-	char *resource_string;
+	unsigned char *resource_string = NULL;
+	unsigned long items, remaining;
+	Atom actual_type;
+	int actual_format;
 	XrmDatabase db;
 	XrmValue value;
 	char *type;
 
 	XrmInitialize();
-	resource_string = XResourceManagerString(display);
-	if (resource_string == NULL)
+	if (XGetWindowProperty(display, DefaultRootWindow(display),
+	    XA_RESOURCE_MANAGER, 0, LONG_MAX / 4, False, XA_STRING,
+	    &actual_type, &actual_format, &items, &remaining,
+	    &resource_string) != Success || resource_string == NULL)
 		return;
 
-	db = XrmGetStringDatabase(resource_string);
+	db = XrmGetStringDatabase((char *)resource_string);
+	XFree(resource_string);
 	if (db == NULL)
 		return;
 
@@ -319,479 +1255,3472 @@ load_xresources(Display *display, struct Config *config)
 	XrmDestroyDatabase(db);
 }
 
-// Update public IP address by querying an external service
-void
-update_public_ip()
+// Return the monotonic clock in nanoseconds
+uint64_t
+monotonic_ns(void)
 {
-	char buffer[1024];
+	struct timespec ts;
 
-	struct addrinfo hints, *res;
-	int sockfd;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
+// Convert an absolute monotonic deadline into a poll(2) timeout
+static int
+poll_timeout(uint64_t deadline, uint64_t now)
+{
+	uint64_t wait;
 
-	if (getaddrinfo("ifconfig.me", "http", &hints, &res) != 0 ||
-	    res == NULL) {
-		perror("getaddrinfo");
-		exit(EXIT_FAILURE);
-	}
+	if (deadline <= now)
+		return 0;
+	wait = (deadline - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+	return wait > INT_MAX ? INT_MAX : (int)wait;
+}
 
-	sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-	if (sockfd == -1) {
-		perror("socket");
-		freeaddrinfo(res);
-		exit(EXIT_FAILURE);
-	}
+// Return the first tick deadline after now on the grid started by
+// deadline, skipping any ticks that were missed entirely
+static uint64_t
+tick_advance(uint64_t deadline, uint64_t interval, uint64_t now)
+{
+	deadline += interval;
+	if (deadline <= now)
+		deadline += ((now - deadline) / interval + 1) * interval;
+	return deadline;
+}
 
-	if (connect(sockfd, res->ai_addr, res->ai_addrlen) == -1) {
-		perror("connect");
-		close(sockfd);
-		freeaddrinfo(res);
-		exit(EXIT_FAILURE);
-	}
+// Add one duration to the stats of a code path. This is a handful of
+// integer operations, so stats are always collected.
+static void
+stat_record(int id, uint64_t ns)
+{
+	struct Stat *stat = &stats[id];
+	int bucket = 0;
+
+	while (bucket < STAT_BUCKETS - 1 && (ns >> (bucket + 1)) != 0)
+		bucket++;
+	if (stat->count == 0 || ns < stat->min)
+		stat->min = ns;
+	if (ns > stat->max)
+		stat->max = ns;
+	stat->count++;
+	stat->total += ns;
+	stat->histogram[bucket]++;
+}
 
-	const char *request = "GET /ip HTTP/1.1\r\nHost: "
-	    "ifconfig.me\r\nConnection: close\r\n\r\n";
-	ssize_t total_sent = 0;
-	ssize_t request_len = strlen(request);
-	while (total_sent < request_len) {
-		ssize_t sent = send(
-		    sockfd, request + total_sent, request_len - total_sent, 0);
-		if (sent == -1) {
-			perror("send");
-			close(sockfd);
-			freeaddrinfo(res);
-			exit(EXIT_FAILURE);
-		}
-		total_sent += sent;
-	}
-
-	ssize_t bytes_received;
-	size_t total_bytes_received = 0;
-	while ((bytes_received = recv(sockfd, buffer + total_bytes_received,
-	    sizeof(buffer) - 1 - total_bytes_received, 0)) > 0) {
-		total_bytes_received += bytes_received;
-	}
-	if (bytes_received == -1) {
-		perror("recv");
-		close(sockfd);
-		freeaddrinfo(res);
-		exit(EXIT_FAILURE);
-	}
+// Format a duration with a unit suited to its magnitude
+static void
+stat_format(char *buffer, size_t size, uint64_t ns)
+{
+	if (ns < 1000)
+		snprintf(buffer, size, "%lluns", (unsigned long long)ns);
+	else if (ns < 1000 * 1000)
+		snprintf(buffer, size, "%.1fus", ns / 1e3);
+	else if (ns < NSEC_PER_SEC)
+		snprintf(buffer, size, "%.1fms", ns / 1e6);
+	else
+		snprintf(buffer, size, "%.2fs", ns / 1e9);
+}
 
-	buffer[total_bytes_received] = '\0';
-	char *ip_start = strstr(buffer, "\r\n\r\n");
-	if (ip_start != NULL) {
-		ip_start += 4; // Skip the "\r\n\r\n"
-		strncpy(public_ip, ip_start, MAX_IP_LENGTH);
-		public_ip[strcspn(public_ip, "\n")] = '\0';
-	} else {
-		strncpy(public_ip, "N/A", MAX_IP_LENGTH);
+// Print the stats of every code path that ran to stderr
+static void
+stats_dump(void)
+{
+	char min[16], mean[16], max[16], low[16], high[16];
+	int id, i;
+
+	fflush(stdout);
+	fprintf(stderr, "%-8s %10s %10s %10s %10s\n", "path", "count", "min",
+	    "mean", "max");
+	for (id = 0; id < STAT_COUNT; id++) {
+		const struct Stat *stat = &stats[id];
+
+		if (stat->count == 0)
+			continue;
+		stat_format(min, sizeof(min), stat->min);
+		stat_format(mean, sizeof(mean), stat->total / stat->count);
+		stat_format(max, sizeof(max), stat->max);
+		fprintf(stderr, "%-8s %10llu %10s %10s %10s\n",
+		    id < MOD_COUNT ? module_info[id].name :
+		    stat_names[id - MOD_COUNT],
+		    (unsigned long long)stat->count, min, mean, max);
+		for (i = 0; i < STAT_BUCKETS; i++) {
+			if (stat->histogram[i] == 0)
+				continue;
+			stat_format(low, sizeof(low), i == 0 ? 0 : 1ULL << i);
+			stat_format(high, sizeof(high), 1ULL << (i + 1));
+			fprintf(stderr, "  %8s - %-8s %10llu\n", low, high,
+			    (unsigned long long)stat->histogram[i]);
+		}
 	}
-
-	close(sockfd);
-	freeaddrinfo(res);
 }
 
-// Update public IPv6 address by querying an external service
-void
-update_public_ipv6()
+// Wake the main loop from a signal handler
+static void
+signal_wake(void)
 {
-	char buffer[1024];
+	int saved_errno = errno;
+	char byte = 0;
 
-	struct addrinfo hints, *res;
-	int sockfd;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET6;
-	hints.ai_socktype = SOCK_STREAM;
+	// A full pipe already has a wakeup pending
+	(void)write(signal_pipe[1], &byte, 1);
+	errno = saved_errno;
+}
 
-	if (getaddrinfo("ifconfig.me", "http", &hints, &res) != 0 ||
-	    res == NULL) {
-		strncpy(public_ipv6, "N/A", sizeof(public_ipv6));
-		return;
-	}
+// Request a stats dump from the main loop
+static void
+stats_signal(int signo)
+{
+	(void)signo;
+	stats_requested = 1;
+	signal_wake();
+}
 
-	sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-	if (sockfd == -1) {
-		freeaddrinfo(res);
-		strncpy(public_ipv6, "N/A", sizeof(public_ipv6));
-		return;
-	}
+// Request a configuration reload from the main loop
+static void
+reload_signal(int signo)
+{
+	(void)signo;
+	reload_requested = 1;
+	signal_wake();
+}
 
-	if (connect(sockfd, res->ai_addr, res->ai_addrlen) == -1) {
-		close(sockfd);
-		freeaddrinfo(res);
-		strncpy(public_ipv6, "N/A", sizeof(public_ipv6));
-		return;
-	}
+// Request the main loop to exit
+static void
+quit_signal(int signo)
+{
+	(void)signo;
+	quit_requested = 1;
+	signal_wake();
+}
 
-	const char *request = "GET /ip HTTP/1.1\r\nHost: "
-	    "ifconfig.me\r\nConnection: close\r\n\r\n";
-	ssize_t total_sent = 0;
-	ssize_t request_len = strlen(request);
-	while (total_sent < request_len) {
-		ssize_t sent = send(
-		    sockfd, request + total_sent, request_len - total_sent, 0);
-		if (sent == -1) {
-			close(sockfd);
-			freeaddrinfo(res);
-			strncpy(public_ipv6, "N/A", sizeof(public_ipv6));
-			return;
-		}
-		total_sent += sent;
-	}
+// Create the self-pipe of the signal handlers. Returns its read end, or
+// -1.
+static int
+signal_open(void)
+{
+	int i;
 
-	ssize_t bytes_received;
-	size_t total_bytes_received = 0;
-	while ((bytes_received = recv(sockfd, buffer + total_bytes_received,
-	    sizeof(buffer) - 1 - total_bytes_received, 0)) > 0) {
-		total_bytes_received += bytes_received;
-	}
-	if (bytes_received == -1) {
-		close(sockfd);
-		freeaddrinfo(res);
-		strncpy(public_ipv6, "N/A", sizeof(public_ipv6));
-		return;
+	if (pipe(signal_pipe) == -1)
+		return -1;
+	for (i = 0; i < 2; i++) {
+		fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC);
+		fcntl(signal_pipe[i], F_SETFL, O_NONBLOCK);
 	}
+	return signal_pipe[0];
+}
 
-	buffer[total_bytes_received] = '\0';
-	char *ip_start = strstr(buffer, "\r\n\r\n");
-	if (ip_start != NULL) {
-		ip_start += 4; // Skip the "\r\n\r\n"
-		strncpy(public_ipv6, ip_start, sizeof(public_ipv6));
-		public_ipv6[strcspn(public_ipv6, "\n")] = '\0';
-	} else {
-		strncpy(public_ipv6, "N/A", sizeof(public_ipv6));
-	}
+// Empty the self-pipe; the flags set by the handlers say what to do
+static void
+signal_drain(void)
+{
+	char buffer[64];
 
-	close(sockfd);
-	freeaddrinfo(res);
+	while (read(signal_pipe[0], buffer, sizeof(buffer)) > 0)
+		continue;
 }
 
-// Get the hostname of the system
-char *
-get_hostname()
+// Install a signal handler that interrupts poll(2) rather than
+// restarting it
+static void
+install_signal(int signo, void (*handler)(int))
 {
-	static char hostname[HOSTNAME_MAX_LENGTH];
+	struct sigaction sa;
 
-	if (gethostname(hostname, HOSTNAME_MAX_LENGTH) == -1) {
-		perror("gethostname");
-		exit(EXIT_FAILURE);
-	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handler;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(signo, &sa, NULL) == -1)
+		perror("sigaction");
+}
 
-	return hostname;
+// Read the address from the body of an HTTP response
+static bool
+pubip_decode_http(const struct PubipFetch *fetch,
+    const struct PubipMethod *method, char *ip, size_t size)
+{
+	const char *body;
+	size_t length;
+
+	(void)method;
+	if (strncmp(fetch->buffer, "HTTP/1.", 7) != 0 ||
+	    strncmp(fetch->buffer + 8, " 200", 4) != 0 ||
+	    (body = strstr(fetch->buffer, "\r\n\r\n")) == NULL)
+		return false;
+	body += 4; // Skip the "\r\n\r\n"
+	body += strspn(body, " \t\r\n");
+	length = strcspn(body, " \t\r\n");
+	if (length == 0 || length >= size)
+		return false;
+	memcpy(ip, body, length);
+	ip[length] = '\0';
+	return true;
 }
 
-// Update internal IP address by querying the specified network interface
-void
-update_internal_ip(struct Config config)
+// Build the HTTP request for GET /ip
+static bool
+pubip_encode_http(struct PubipFetch *fetch, const struct PubipMethod *method)
 {
-	struct ifaddrs *ifap, *ifa;
-	struct sockaddr_in *sa;
+	int length;
 
-	if (getifaddrs(&ifap) == -1) {
-		perror("getifaddrs");
-		exit(EXIT_FAILURE);
+	(void)method;
+	length = snprintf(fetch->request, sizeof(fetch->request),
+	    "GET /ip HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+	    fetch->host);
+	if (length < 0 || (size_t)length >= sizeof(fetch->request))
+		return false;
+	fetch->request_len = (size_t)length;
+	return true;
+}
+
+// Build a DNS query for the name of the resolver, with recursion
+// desired, as a single datagram
+static bool
+pubip_encode_dns(struct PubipFetch *fetch, const struct PubipMethod *method)
+{
+	unsigned char *start = (unsigned char *)fetch->request;
+	unsigned char *p = start, *end = start + sizeof(fetch->request);
+	const char *label = method->query;
+	uint16_t qtype = method->qtype;
+
+	if (qtype == 0)
+		qtype = fetch->family == AF_INET6 ? DNS_TYPE_AAAA : DNS_TYPE_A;
+	platform_random(fetch->txid, 2);
+	memset(p, 0, DNS_HEADER_SIZE);
+	p[0] = fetch->txid[0];
+	p[1] = fetch->txid[1];
+	p[2] = 0x01; // RD
+	p[5] = 1; // QDCOUNT
+	p += DNS_HEADER_SIZE;
+	while (*label != '\0') {
+		size_t length = strcspn(label, ".");
+
+		if (length == 0 || length > 63 || p + length + 6 > end)
+			return false;
+		*p++ = (unsigned char)length;
+		memcpy(p, label, length);
+		p += length;
+		label += length;
+		if (*label == '.')
+			label++;
 	}
+	*p++ = 0;
+	*p++ = qtype >> 8;
+	*p++ = qtype & 0xff;
+	*p++ = 0;
+	*p++ = 1; // IN
+	fetch->request_len = p - start;
+	return true;
+}
 
-	// Search for the specified interface
-	bool found_interface = false;
-	for (ifa = ifap; ifa != NULL; ifa = ifa->ifa_next) {
-		if (config.interface != NULL &&
-		    strcmp(ifa->ifa_name, config.interface) == 0 &&
-		    ifa->ifa_addr != NULL &&
-		    ifa->ifa_addr->sa_family == AF_INET) {
-			sa = (struct sockaddr_in *)ifa->ifa_addr;
-			inet_ntop(AF_INET, &(sa->sin_addr), internal_ip,
-			    sizeof(internal_ip));
-			found_interface = true;
-			break;
-		}
+// Skip a possibly compressed name in a DNS message. Returns the first
+// byte after it, or NULL if the name is malformed.
+static const unsigned char *
+dns_skip_name(const unsigned char *p, const unsigned char *end)
+{
+	while (p < end) {
+		if ((*p & 0xc0) == 0xc0)
+			return end - p >= 2 ? p + 2 : NULL;
+		if (*p & 0xc0)
+			return NULL;
+		if (*p == 0)
+			return p + 1;
+		p += *p + 1;
 	}
+	return NULL;
+}
 
-	// Fallback to lo0 if no other interface is found
-	if (!found_interface) {
-		strlcpy(internal_ip, "lo0", sizeof(internal_ip));
+// Read the address from the answers of a DNS response: an A or AAAA
+// record of the address family, or a TXT record holding the address as
+// text
+static bool
+pubip_decode_dns(const struct PubipFetch *fetch,
+    const struct PubipMethod *method, char *ip, size_t size)
+{
+	const unsigned char *msg = (const unsigned char *)fetch->buffer;
+	const unsigned char *p, *end = msg + fetch->received;
+	unsigned char addr[sizeof(struct in6_addr)];
+	int questions, answers;
+
+	(void)method;
+	if (fetch->received < DNS_HEADER_SIZE || msg[0] != fetch->txid[0] ||
+	    msg[1] != fetch->txid[1] || !(msg[2] & 0x80) ||
+	    (msg[3] & 0x0f) != 0)
+		return false;
+	questions = msg[4] << 8 | msg[5];
+	answers = msg[6] << 8 | msg[7];
+
+	p = msg + DNS_HEADER_SIZE;
+	while (questions-- > 0) {
+		if ((p = dns_skip_name(p, end)) == NULL || end - p < 4)
+			return false;
+		p += 4; // QTYPE and QCLASS
+	}
+	while (answers-- > 0) {
+		int type, length;
+
+		if ((p = dns_skip_name(p, end)) == NULL || end - p < 10)
+			return false;
+		type = p[0] << 8 | p[1];
+		length = p[8] << 8 | p[9];
+		p += 10; // TYPE, CLASS, TTL and RDLENGTH
+		if (end - p < length)
+			return false;
+		if ((type == DNS_TYPE_A && length == 4 &&
+		    fetch->family == AF_INET) ||
+		    (type == DNS_TYPE_AAAA && length == 16 &&
+		    fetch->family == AF_INET6))
+			return inet_ntop(fetch->family, p, ip, size) != NULL;
+		// The first string of a TXT record, when it is an address
+		if (type == DNS_TYPE_TXT && length > 0 && p[0] < length &&
+		    (size_t)p[0] < size) {
+			memcpy(ip, p + 1, p[0]);
+			ip[p[0]] = '\0';
+			if (inet_pton(fetch->family, ip, addr) == 1)
+				return true;
+		}
+		p += length;
 	}
+	return false;
+}
 
-	freeifaddrs(ifap);
+// Build a STUN Binding request with a fresh transaction ID
+static bool
+pubip_encode_stun(struct PubipFetch *fetch, const struct PubipMethod *method)
+{
+	unsigned char *p = (unsigned char *)fetch->request;
+
+	(void)method;
+	platform_random(fetch->txid, sizeof(fetch->txid));
+	p[0] = STUN_BINDING_REQUEST >> 8;
+	p[1] = STUN_BINDING_REQUEST & 0xff;
+	p[2] = 0; // No attributes
+	p[3] = 0;
+	p[4] = STUN_MAGIC_COOKIE >> 24;
+	p[5] = (STUN_MAGIC_COOKIE >> 16) & 0xff;
+	p[6] = (STUN_MAGIC_COOKIE >> 8) & 0xff;
+	p[7] = STUN_MAGIC_COOKIE & 0xff;
+	memcpy(p + 8, fetch->txid, sizeof(fetch->txid));
+	fetch->request_len = STUN_HEADER_SIZE;
+	return true;
 }
 
-// Update VPN status by checking for active WireGuard interfaces
+// Read the reflexive address from a STUN Binding response, preferring
+// XOR-MAPPED-ADDRESS to the MAPPED-ADDRESS of older servers. The XOR
+// key, the magic cookie followed by the transaction ID, is the 16 bytes
+// of the header after the type and length.
+static bool
+pubip_decode_stun(const struct PubipFetch *fetch,
+    const struct PubipMethod *method, char *ip, size_t size)
+{
+	const unsigned char *msg = (const unsigned char *)fetch->buffer;
+	const unsigned char *p, *end;
+	unsigned char addr[sizeof(struct in6_addr)];
+	int family = fetch->family == AF_INET6 ? 2 : 1;
+	int length = fetch->family == AF_INET6 ? 16 : 4;
+	bool found = false;
+	int i;
+
+	(void)method;
+	if (fetch->received < STUN_HEADER_SIZE ||
+	    (msg[0] << 8 | msg[1]) != STUN_BINDING_RESPONSE ||
+	    memcmp(msg + 8, fetch->txid, sizeof(fetch->txid)) != 0 ||
+	    STUN_HEADER_SIZE + (size_t)(msg[2] << 8 | msg[3]) >
+	    fetch->received)
+		return false;
+
+	p = msg + STUN_HEADER_SIZE;
+	end = p + (msg[2] << 8 | msg[3]);
+	while (end - p >= 4) {
+		int type = p[0] << 8 | p[1];
+		int attr_length = p[2] << 8 | p[3];
+
+		p += 4;
+		if (end - p < attr_length)
+			return false;
+		if ((type == STUN_XOR_MAPPED_ADDRESS ||
+		    (type == STUN_MAPPED_ADDRESS && !found)) &&
+		    attr_length >= 4 + length && p[1] == family) {
+			for (i = 0; i < length; i++)
+				addr[i] = p[4 + i] ^
+				    (type == STUN_XOR_MAPPED_ADDRESS ?
+				    msg[4 + i] : 0);
+			found = true;
+			if (type == STUN_XOR_MAPPED_ADDRESS)
+				break;
+		}
+		p += (attr_length + 3) & ~3; // Attributes are 32-bit aligned
+	}
+	return found && inet_ntop(fetch->family, addr, ip, size) != NULL;
+}
+
+// Resolvers by pubip_method. OpenDNS answers myip.opendns.com with the
+// address of the client, and Google answers o-o.myaddr.l.google.com with
+// it as a TXT record.
+static const struct PubipMethod pubip_methods[PUBIP_METHOD_COUNT] = {
+	[PUBIP_HTTP] = {"ifconfig.me", "http", SOCK_STREAM, NULL, 0,
+	    pubip_encode_http, pubip_decode_http},
+	[PUBIP_DNS] = {"resolver1.opendns.com", "domain", SOCK_DGRAM,
+	    "myip.opendns.com", 0, pubip_encode_dns, pubip_decode_dns},
+	[PUBIP_DNS_TXT] = {"ns1.google.com", "domain", SOCK_DGRAM,
+	    "o-o.myaddr.l.google.com", DNS_TYPE_TXT, pubip_encode_dns,
+	    pubip_decode_dns},
+	[PUBIP_STUN] = {"stun.l.google.com", "19302", SOCK_DGRAM, NULL, 0,
+	    pubip_encode_stun, pubip_decode_stun},
+};
+
+// Point a fetcher at the resolver and server of a configuration. The
+// server defaults to the public one of the resolver.
+static void
+pubip_configure(struct PubipFetch *fetch, const struct Config *config)
+{
+	const struct PubipMethod *method =
+	    &pubip_methods[config->public_ip_resolver];
+
+	fetch->method = config->public_ip_resolver;
+	fetch->host = config->public_ip_host != NULL ?
+	    config->public_ip_host : method->host;
+	fetch->port = config->public_ip_port != NULL ?
+	    config->public_ip_port : method->port;
+	fetch->refresh = (uint64_t)config->public_ip_interval * NSEC_PER_SEC;
+}
+
+// Reset a public IP fetcher to its initial, idle state
+static void
+pubip_init(struct PubipFetch *fetch, int family, char *value, size_t size,
+    const struct Config *config)
+{
+	memset(fetch, 0, sizeof(*fetch));
+	fetch->family = family;
+	fetch->state = PUBIP_IDLE;
+	fetch->fd = -1;
+	fetch->value = value;
+	fetch->value_size = size;
+	pubip_configure(fetch, config);
+	strlcpy(value, "N/A", size);
+}
+
+// Release the socket and resolver state of an in-flight fetch
+static void
+pubip_close(struct PubipFetch *fetch)
+{
+	if (fetch->query != NULL) {
+		platform_resolve_abort(fetch->query);
+		fetch->query = NULL;
+	}
+	if (fetch->fd != -1) {
+		close(fetch->fd);
+		fetch->fd = -1;
+	}
+	if (fetch->res != NULL) {
+		freeaddrinfo(fetch->res);
+		fetch->res = NULL;
+	}
+	fetch->ai = NULL;
+	fetch->events = 0;
+}
+
+// Point a fetcher at a reloaded configuration. A new resolver or server
+// restarts the fetch at once; otherwise the fetch in flight and the last value
+// are kept.
+static void
+pubip_reconfigure(struct PubipFetch *fetch, const struct Config *old,
+    const struct Config *config)
+{
+	if (old->public_ip_resolver != config->public_ip_resolver ||
+	    config_changed(old->public_ip_host, config->public_ip_host) ||
+	    config_changed(old->public_ip_port, config->public_ip_port)) {
+		pubip_close(fetch);
+		pubip_init(fetch, fetch->family, fetch->value,
+		    fetch->value_size, config);
+		return;
+	}
+	pubip_configure(fetch, config);
+}
+
+// Give up on the current attempt and schedule a retry with backoff.
+// The last known value is kept so the bar keeps showing it.
+static void
+pubip_fail(struct PubipFetch *fetch, uint64_t now)
+{
+	uint64_t backoff = PUBIP_BACKOFF_MIN;
+	unsigned int i;
+
+	pubip_close(fetch);
+	for (i = 0; i < fetch->failures && backoff < PUBIP_BACKOFF_MAX; i++)
+		backoff *= 2;
+	if (backoff > PUBIP_BACKOFF_MAX)
+		backoff = PUBIP_BACKOFF_MAX;
+	if (fetch->failures < UINT_MAX)
+		fetch->failures++;
+	fetch->state = PUBIP_IDLE;
+	fetch->next_start = now + backoff;
+}
+
+// Extract and validate the address from a complete response
+static void
+pubip_finish(struct PubipFetch *fetch, uint64_t now)
+{
+	const struct PubipMethod *method = &pubip_methods[fetch->method];
+	unsigned char addr[sizeof(struct in6_addr)];
+	char ip[INET6_ADDRSTRLEN];
+
+	fetch->buffer[fetch->received] = '\0';
+	if (!method->decode(fetch, method, ip, sizeof(ip)) ||
+	    inet_pton(fetch->family, ip, addr) != 1) {
+		pubip_fail(fetch, now);
+		return;
+	}
+
+	if (strcmp(fetch->value, ip) != 0) {
+		strlcpy(fetch->value, ip, fetch->value_size);
+		fetch->updated = true;
+	}
+	fetch->fetched = time(NULL);
+	fetch->cache_dirty = true;
+	pubip_close(fetch);
+	fetch->failures = 0;
+	fetch->state = PUBIP_IDLE;
+	fetch->next_start = now + fetch->refresh;
+}
+
+// Start a non-blocking connect to the next resolved address
+static void
+pubip_connect(struct PubipFetch *fetch, uint64_t now)
+{
+	for (; fetch->ai != NULL; fetch->ai = fetch->ai->ai_next) {
+		struct addrinfo *ai = fetch->ai;
+
+		fetch->fd = socket(ai->ai_family,
+		    ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    ai->ai_protocol);
+		if (fetch->fd == -1)
+			continue;
+		if (connect(fetch->fd, ai->ai_addr, ai->ai_addrlen) == 0 ||
+		    errno == EINPROGRESS) {
+			fetch->state = PUBIP_CONNECTING;
+			fetch->events = POLLOUT;
+			fetch->wake = now + PUBIP_CONNECT_TIMEOUT;
+			if (fetch->wake > fetch->deadline)
+				fetch->wake = fetch->deadline;
+			return;
+		}
+		close(fetch->fd);
+		fetch->fd = -1;
+	}
+	pubip_fail(fetch, now);
+}
+
+// Drive the resolver until it either completes or needs to wait
+static void
+pubip_resolve(struct PubipFetch *fetch, uint64_t now)
+{
+	struct ResolveWait wait;
+	struct addrinfo *res;
+
+	if (platform_resolve_run(fetch->query, &res, &wait) == 0) {
+		fetch->fd_resolve = wait.fd;
+		fetch->events = wait.events;
+		fetch->wake = fetch->deadline;
+		if (wait.timeout >= 0 &&
+		    now + (uint64_t)wait.timeout * NSEC_PER_MSEC < fetch->wake)
+			fetch->wake = now +
+			    (uint64_t)wait.timeout * NSEC_PER_MSEC;
+		return;
+	}
+	fetch->query = NULL; // Released on completion
+	if (res == NULL) {
+		pubip_fail(fetch, now);
+		return;
+	}
+	fetch->res = res;
+	fetch->ai = fetch->res;
+	pubip_connect(fetch, now);
+}
+
+// Begin a new fetch if the fetcher is idle and the next attempt is due
+static void
+pubip_start(struct PubipFetch *fetch, uint64_t now)
+{
+	const struct PubipMethod *method = &pubip_methods[fetch->method];
+	struct addrinfo hints;
+
+	if (fetch->state != PUBIP_IDLE || now < fetch->next_start)
+		return;
+
+	if (!method->encode(fetch, method)) {
+		pubip_fail(fetch, now);
+		return;
+	}
+	fetch->sent = 0;
+	fetch->received = 0;
+	fetch->deadline = now + PUBIP_TIMEOUT;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = fetch->family;
+	hints.ai_socktype = method->socktype;
+	fetch->query = platform_resolve_start(fetch->host, fetch->port, &hints);
+	if (fetch->query == NULL) {
+		pubip_fail(fetch, now);
+		return;
+	}
+	fetch->state = PUBIP_RESOLVING;
+	pubip_resolve(fetch, now);
+}
+
+// Return the descriptor the fetcher is waiting on, or -1 if none
+static int
+pubip_fd(const struct PubipFetch *fetch)
+{
+	switch (fetch->state) {
+	case PUBIP_RESOLVING:
+		return fetch->fd_resolve;
+	case PUBIP_CONNECTING:
+	case PUBIP_SENDING:
+	case PUBIP_RECEIVING:
+		return fetch->fd;
+	default:
+		return -1;
+	}
+}
+
+// Return the absolute deadline at which the fetcher next needs service
+static uint64_t
+pubip_wake(const struct PubipFetch *fetch)
+{
+	return fetch->state == PUBIP_IDLE ? fetch->next_start : fetch->wake;
+}
+
+// Advance the fetch state machine without ever blocking.
+// revents holds the poll(2) result for pubip_fd(), or 0 on a timeout.
+static void
+pubip_step(struct PubipFetch *fetch, short revents, uint64_t now)
+{
+	bool datagram = pubip_methods[fetch->method].socktype == SOCK_DGRAM;
+	ssize_t n;
+	int error;
+	socklen_t error_len;
+
+	if (fetch->state == PUBIP_IDLE) {
+		pubip_start(fetch, now);
+		return;
+	}
+	if (now >= fetch->deadline) {
+		pubip_fail(fetch, now);
+		return;
+	}
+
+	switch (fetch->state) {
+	case PUBIP_RESOLVING:
+		if (revents != 0 || now >= fetch->wake)
+			pubip_resolve(fetch, now);
+		break;
+	case PUBIP_CONNECTING:
+		if (revents == 0) {
+			if (now < fetch->wake)
+				break;
+			// This address timed out; try the next one
+			close(fetch->fd);
+			fetch->fd = -1;
+			fetch->ai = fetch->ai->ai_next;
+			pubip_connect(fetch, now);
+			break;
+		}
+		error = 0;
+		error_len = sizeof(error);
+		if (getsockopt(fetch->fd, SOL_SOCKET, SO_ERROR, &error,
+		    &error_len) == -1 || error != 0) {
+			close(fetch->fd);
+			fetch->fd = -1;
+			fetch->ai = fetch->ai->ai_next;
+			pubip_connect(fetch, now);
+			break;
+		}
+		fetch->state = PUBIP_SENDING;
+		fetch->wake = fetch->deadline;
+		/* FALLTHROUGH */
+	case PUBIP_SENDING:
+		n = send(fetch->fd, fetch->request + fetch->sent,
+		    fetch->request_len - fetch->sent, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				pubip_fail(fetch, now);
+			break;
+		}
+		fetch->sent += (size_t)n;
+		if (fetch->sent == fetch->request_len) {
+			fetch->state = PUBIP_RECEIVING;
+			fetch->events = POLLIN;
+			// A lost datagram is given up on like a connection
+			// that times out
+			if (datagram &&
+			    now + PUBIP_CONNECT_TIMEOUT < fetch->deadline)
+				fetch->wake = now + PUBIP_CONNECT_TIMEOUT;
+		}
+		break;
+	case PUBIP_RECEIVING:
+		if (revents == 0) {
+			if (!datagram || now < fetch->wake)
+				break;
+			// No answer from this address; ask the next one
+			close(fetch->fd);
+			fetch->fd = -1;
+			fetch->ai = fetch->ai->ai_next;
+			fetch->sent = 0;
+			fetch->received = 0;
+			pubip_connect(fetch, now);
+			break;
+		}
+		n = recv(fetch->fd, fetch->buffer + fetch->received,
+		    sizeof(fetch->buffer) - 1 - fetch->received, 0);
+		if (n == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				pubip_fail(fetch, now);
+			break;
+		}
+		fetch->received += (size_t)n;
+		// A datagram is a whole response; an HTTP server closes the
+		// connection once the body is sent
+		if (datagram || n == 0 ||
+		    fetch->received == sizeof(fetch->buffer) - 1)
+			pubip_finish(fetch, now);
+		break;
+	default:
+		break;
+	}
+}
+
+// Return the name of an address family in the public IP cache
+static const char *
+pubip_family_name(int family)
+{
+	return family == AF_INET6 ? "inet6" : "inet";
+}
+
+// Show the public addresses saved by a previous run right away. A value
+// younger than the refresh interval is only fetched again once it
+// expires; an older one is marked stale with a trailing "?" until the
+// fetch started at once replaces it.
+static void
+pubip_cache_load(struct PubipFetch *fetches, int count, uint64_t now)
+{
+	unsigned char addr[sizeof(struct in6_addr)];
+	char line[128], family[8], ip[INET6_ADDRSTRLEN];
+	long long fetched;
+	time_t wall = time(NULL);
+	uint64_t age;
+	FILE *file;
+	int i;
+
+	if (pubip_cache_path[0] == '\0' ||
+	    (file = fopen(pubip_cache_path, "r")) == NULL)
+		return;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (sscanf(line, "%7s %45s %lld", family, ip, &fetched) != 3)
+			continue;
+		for (i = 0; i < count; i++) {
+			struct PubipFetch *fetch = &fetches[i];
+
+			if (strcmp(family, pubip_family_name(fetch->family)) !=
+			    0 || inet_pton(fetch->family, ip, addr) != 1)
+				continue;
+			strlcpy(fetch->value, ip, fetch->value_size);
+			fetch->fetched = (time_t)fetched;
+			age = fetched < wall ?
+			    (uint64_t)(wall - fetched) * NSEC_PER_SEC : 0;
+			if (age < fetch->refresh)
+				fetch->next_start = now + fetch->refresh - age;
+			else
+				strlcat(fetch->value, "?", fetch->value_size);
+		}
+	}
+	fclose(file);
+}
+
+// Rewrite the public IP cache with the last fetched address of each
+// family and its wall-clock fetch time. The file is replaced with
+// rename(2), so a reader never sees half of it.
+static void
+pubip_cache_save(const struct PubipFetch *fetches, int count)
+{
+	char tmp[PATH_MAX];
+	FILE *file;
+	int i, length;
+
+	if (pubip_cache_path[0] == '\0')
+		return;
+	length = snprintf(tmp, sizeof(tmp), "%s.tmp", pubip_cache_path);
+	if (length < 0 || (size_t)length >= sizeof(tmp))
+		return;
+	if ((file = fopen(tmp, "w")) == NULL) {
+		perror(tmp);
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		const struct PubipFetch *fetch = &fetches[i];
+
+		if (fetch->fetched == 0)
+			continue;
+		fprintf(file, "%s %.*s %lld\n",
+		    pubip_family_name(fetch->family),
+		    (int)strcspn(fetch->value, "?"), fetch->value,
+		    (long long)fetch->fetched);
+	}
+	if (fclose(file) == EOF || rename(tmp, pubip_cache_path) == -1) {
+		perror(pubip_cache_path);
+		unlink(tmp);
+	}
+}
+
+// Add the descriptors of the public IP fetchers to a poll set.
+// slot[i] receives the pollfd index of fetcher i, or -1 if it is not
+// waiting on a descriptor. Unless start is set, idle fetchers do not
+// wake the loop to start their next fetch. Returns the earliest wakeup
+// among fetchers.
+static uint64_t
+pubip_pollfds(struct PubipFetch *fetches, int count, struct pollfd *pfd,
+    int *nfds, int *slot, bool start)
+{
+	uint64_t wake = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		struct PubipFetch *fetch = &fetches[i];
+		int fd = pubip_fd(fetch);
+
+		slot[i] = -1;
+		if (!start && fetch->state == PUBIP_IDLE)
+			continue;
+		if (pubip_wake(fetch) < wake)
+			wake = pubip_wake(fetch);
+		if (fd != -1) {
+			pfd[*nfds].fd = fd;
+			pfd[*nfds].events = fetch->events;
+			pfd[*nfds].revents = 0;
+			slot[i] = (*nfds)++;
+		}
+	}
+	return wake;
+}
+
+// Step every fetcher that has poll(2) events pending or whose wakeup
+// time has passed, and save the cache after a successful fetch. Unless
+// start is set, only the fetches in flight advance. Returns true if any
+// public address changed.
+static bool
+pubip_dispatch(struct PubipFetch *fetches, int count,
+    const struct pollfd *pfd, const int *slot, uint64_t now, bool start)
+{
+	bool updated = false, save = false;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		short revents = slot[i] == -1 ? 0 : pfd[slot[i]].revents;
+
+		if (!start && fetches[i].state == PUBIP_IDLE)
+			continue;
+		if (revents != 0 || now >= pubip_wake(&fetches[i]))
+			pubip_step(&fetches[i], revents, now);
+		if (fetches[i].updated) {
+			fetches[i].updated = false;
+			updated = true;
+		}
+		if (fetches[i].cache_dirty) {
+			fetches[i].cache_dirty = false;
+			save = true;
+		}
+	}
+	if (save)
+		pubip_cache_save(fetches, count);
+	return updated;
+}
+
+// Open the write section of the seqlock of a module. Only one collector
+// runs a given module at a time, so writers never race each other.
+static void
+module_publish_begin(int id)
+{
+	__atomic_store_n(&module_seq[id], module_seq[id] + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// Close the write section of the seqlock of a module
+static void
+module_publish_end(int id)
+{
+	__atomic_store_n(&module_seq[id], module_seq[id] + 1, __ATOMIC_RELEASE);
+}
+
+// Start reading the values of a module. A write section only copies a
+// few hundred bytes, so waiting for an odd sequence spins briefly.
+static unsigned int
+module_read_begin(int id)
+{
+	unsigned int seq;
+
+	while ((seq = __atomic_load_n(&module_seq[id], __ATOMIC_ACQUIRE)) & 1)
+		;
+	return seq;
+}
+
+// Return whether the values read since module_read_begin() may be torn
+// by a concurrent write and must be read again
+static bool
+module_read_retry(int id, unsigned int seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&module_seq[id], __ATOMIC_RELAXED) != seq;
+}
+
+// Update the hostname of the system
+void
+update_hostname()
+{
+	char name[HOSTNAME_MAX_LENGTH];
+
+	if (gethostname(name, sizeof(name)) == -1) {
+		perror("gethostname");
+		exit(EXIT_FAILURE);
+	}
+	name[sizeof(name) - 1] = '\0';
+
+	module_publish_begin(MOD_HOSTNAME);
+	strlcpy(hostname, name, sizeof(hostname));
+	module_publish_end(MOD_HOSTNAME);
+}
+
+// Drain the routing socket of the platform backend. Returns true if any
+// message reported an interface or address change, which marks the
+// snapshot stale.
+static bool
+iface_route_changed(struct IfaceCache *cache)
+{
+	if (!platform_route_changed(cache->route_fd))
+		return false;
+	__atomic_store_n(&cache->stale, true, __ATOMIC_RELAXED);
+	return true;
+}
+
+// Return the snapshot entry for an interface, adding it if needed
+static struct IfaceEntry *
+iface_entry(struct IfaceCache *cache, const char *name)
+{
+	struct IfaceEntry *entry;
+	int i;
+
+	for (i = 0; i < cache->count; i++) {
+		if (strcmp(cache->entries[i].name, name) == 0)
+			return &cache->entries[i];
+	}
+	if (cache->count == IFACE_MAX)
+		return NULL;
+	entry = &cache->entries[cache->count++];
+	memset(entry, 0, sizeof(*entry));
+	strlcpy(entry->name, name, sizeof(entry->name));
+	return entry;
+}
+
+// Refresh the interface snapshot with a single getifaddrs() walk when
+// it is stale. Without a routing socket the snapshot also expires after
+// IFACE_MAX_AGE, so that modules sampled together share one walk. The
+// traffic module asks for counters, which only a snapshot younger than
+// IFACE_FRESH satisfies. The caller holds iface_lock.
+static const struct IfaceCache *
+iface_snapshot(struct IfaceCache *cache, bool counters)
+{
+	struct ifaddrs *ifap, *ifa;
+	struct IfaceEntry *entry;
+	uint64_t now = monotonic_ns();
+	uint64_t max_age;
+
+	max_age = counters ? IFACE_FRESH :
+	    cache->route_fd != -1 ? UINT64_MAX : IFACE_MAX_AGE;
+	if (!__atomic_exchange_n(&cache->stale, false, __ATOMIC_RELAXED) &&
+	    now - cache->taken < max_age)
+		return cache;
+
+	if (getifaddrs(&ifap) == -1) {
+		perror("getifaddrs");
+		exit(EXIT_FAILURE);
+	}
+
+	cache->count = 0;
+	for (ifa = ifap; ifa != NULL; ifa = ifa->ifa_next) {
+		entry = iface_entry(cache, ifa->ifa_name);
+		if (entry == NULL)
+			continue;
+		entry->flags = ifa->ifa_flags;
+		if (!entry->has_bytes)
+			entry->has_bytes = platform_iface_bytes(ifa,
+			    &entry->rx, &entry->tx, &entry->bits);
+		if (!entry->has_inet && ifa->ifa_addr != NULL &&
+		    ifa->ifa_addr->sa_family == AF_INET) {
+			entry->inet = ((struct sockaddr_in *)ifa->ifa_addr)
+			    ->sin_addr;
+			entry->has_inet = true;
+		}
+	}
+	freeifaddrs(ifap);
+
+	cache->taken = now;
+	return cache;
+}
+
+// Update internal IP address of the specified network interface from the
+// interface snapshot
+void
+update_internal_ip(struct Config config)
+{
+	const struct IfaceCache *cache;
+	char address[INET_ADDRSTRLEN];
+	int i;
+
+	pthread_mutex_lock(&iface_lock);
+	cache = iface_snapshot(&iface_cache, false);
+
+	// Search for the specified interface
+	bool found_interface = false;
+	for (i = 0; i < cache->count && config.interface != NULL; i++) {
+		const struct IfaceEntry *entry = &cache->entries[i];
+
+		if (strcmp(entry->name, config.interface) == 0 &&
+		    entry->has_inet) {
+			inet_ntop(AF_INET, &entry->inet, address,
+			    sizeof(address));
+			found_interface = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&iface_lock);
+
+	// Fallback to lo0 if no other interface is found
+	if (!found_interface) {
+		strlcpy(address, "lo0", sizeof(address));
+	}
+
+	module_publish_begin(MOD_NET);
+	strlcpy(internal_ip, address, sizeof(internal_ip));
+	module_publish_end(MOD_NET);
+}
+
+// Update VPN status by checking the interface snapshot for active
+// WireGuard interfaces
 void
 update_vpn()
 {
-	struct ifaddrs *ifap, *ifa;
-	volatile int has_wg_interface = 0;
+	const struct IfaceCache *cache;
+	int has_wg_interface = 0;
+	int i;
+
+	pthread_mutex_lock(&iface_lock);
+	cache = iface_snapshot(&iface_cache, false);
+
+	// Check for wgX interfaces
+	for (i = 0; i < cache->count; i++) {
+		if (strncmp(cache->entries[i].name, "wg", 2) == 0 &&
+		    cache->entries[i].flags & IFF_UP) {
+			has_wg_interface = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&iface_lock);
+
+	module_publish_begin(MOD_VPN);
+	if (has_wg_interface)
+		snprintf(vpn_status, sizeof(vpn_status), "VPN");
+	else
+		snprintf(vpn_status, sizeof(vpn_status), "No VPN");
+	module_publish_end(MOD_VPN);
+}
+
+// Update memory information from the platform backend
+unsigned long long
+update_mem()
+{
+	unsigned long long freemem;
+
+	if (!platform_free_memory(&freemem)) {
+		fprintf(stderr, "Error: Failed to get free memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return freemem;
+}
+
+// Append a sample to the history of a metric, overwriting the oldest
+static void
+history_push(int id, double value)
+{
+	struct History *h = &history[id];
+
+	h->samples[h->head] = value;
+	h->head = (h->head + 1) % HISTORY_MAX;
+	if (h->count < HISTORY_MAX)
+		h->count++;
+}
+
+// Write the last samples of a metric as a sparkline, oldest first, with
+// one block character from U+2581 to U+2588 per sample. Returns the
+// number of bytes written.
+static size_t
+history_sparkline(int id, unsigned int samples, char *buffer, size_t size)
+{
+	static const char *blocks[] = {"\u2581", "\u2582", "\u2583",
+	    "\u2584", "\u2585", "\u2586", "\u2587", "\u2588"};
+	const struct History *h = &history[id];
+	double value, scale = h->floor;
+	size_t length = 0;
+	int i, n, slot, level;
+
+	n = h->count < (int)samples ? h->count : (int)samples;
+	for (i = 0; i < n; i++) {
+		slot = (h->head - n + i + HISTORY_MAX) % HISTORY_MAX;
+		if (h->samples[slot] > scale)
+			scale = h->samples[slot];
+	}
+	for (i = 0; i < n && length + 3 < size; i++) {
+		slot = (h->head - n + i + HISTORY_MAX) % HISTORY_MAX;
+		value = h->samples[slot] < 0 ? 0 : h->samples[slot];
+		level = (int)(value * 8 / scale);
+		if (level > 7)
+			level = 7;
+		memcpy(buffer + length, blocks[level], 3);
+		length += 3;
+	}
+	return length;
+}
+
+// Return how much a cumulative counter advanced, treating a counter
+// that went backwards (a CPU that was taken offline) as idle
+static uint64_t
+counter_delta(uint64_t prev, uint64_t cur)
+{
+	return cur >= prev ? cur - prev : 0;
+}
+
+// Sample the per-core CPU times and compute the utilization since the
+// previous sample: the aggregate user, system, interrupt and idle
+// percentages, and a mini-graph with one block character per core.
+static void
+update_cpu_usage(void)
+{
+	static const char *blocks[] = {"\u2581", "\u2582", "\u2583",
+	    "\u2584", "\u2585", "\u2586", "\u2587", "\u2588"};
+	struct CpuTimes *prev = cpu_usage.times[cpu_usage.current];
+	struct CpuTimes *cur = cpu_usage.times[cpu_usage.current ^ 1];
+	uint64_t user = 0, sys = 0, intr = 0, idle = 0, total;
+	uint64_t core_busy, core_total, level;
+	char cores[sizeof(cpu_cores)];
+	char *p = cores;
+	int i, count;
+
+	if ((count = platform_cpu_times(cur, CPU_MAX)) == -1) {
+		fprintf(stderr, "Error: Failed to get CPU times\n");
+		return;
+	}
+	// Cores that appeared since the last sample start from zero
+	for (i = cpu_usage.count; i < count; i++)
+		memset(&prev[i], 0, sizeof(prev[i]));
+
+	for (i = 0; i < count; i++) {
+		uint64_t u, s, n, d;
+
+		u = counter_delta(prev[i].user + prev[i].nice,
+		    cur[i].user + cur[i].nice);
+		s = counter_delta(prev[i].sys, cur[i].sys);
+		n = counter_delta(prev[i].intr, cur[i].intr);
+		d = counter_delta(prev[i].idle, cur[i].idle);
+		user += u;
+		sys += s;
+		intr += n;
+		idle += d;
+
+		// Offline CPUs report no time at all and get no block
+		if (cur[i].user + cur[i].nice + cur[i].sys + cur[i].intr +
+		    cur[i].idle == 0)
+			continue;
+		core_busy = u + s + n;
+		core_total = core_busy + d;
+		// One level per eighth of busy time; a fully busy core, at
+		// eight eighths, gets the last
+		level = core_total == 0 ? 0 : core_busy * 8 / core_total;
+		if (level > 7)
+			level = 7;
+		memcpy(p, blocks[level], 3);
+		p += 3;
+	}
+	*p = '\0';
+
+	total = user + sys + intr + idle;
+	module_publish_begin(MOD_USAGE);
+	memcpy(cpu_cores, cores, p - cores + 1);
+	if (total > 0) {
+		cpu_usage.user = 100.0 * user / total;
+		cpu_usage.sys = 100.0 * sys / total;
+		cpu_usage.intr = 100.0 * intr / total;
+		cpu_usage.idle = 100.0 * idle / total;
+		history_push(HIST_USAGE, 100.0 - cpu_usage.idle);
+	}
+	module_publish_end(MOD_USAGE);
+	cpu_usage.count = count;
+	cpu_usage.current ^= 1;
+}
+
+// Return how much a byte counter of the given width in bits advanced. A
+// 32-bit counter that went backwards wrapped around, as on Linux; a
+// 64-bit one never wraps, so it was reset with the interface and counts
+// from zero.
+static uint64_t
+traffic_delta(uint64_t prev, uint64_t cur, unsigned int bits)
+{
+	if (cur >= prev)
+		return cur - prev;
+	if (bits == 32)
+		return cur + (UINT32_MAX - prev) + 1;
+	return cur;
+}
+
+// Compute the receive and transmit rates of the configured interface,
+// or of all the interfaces but the loopback ones, from the byte counters
+// in the interface snapshot. The snapshot walk is shared with the VPN
+// and network modules, and interfaces seen for the first time count from
+// the next sample.
+static void
+update_traffic(const struct Config *config)
+{
+	const struct IfaceCache *cache;
+	const struct TrafficCounter *prev = traffic.counters[traffic.current];
+	struct TrafficCounter *cur = traffic.counters[traffic.current ^ 1];
+	int prev_count = traffic.count[traffic.current], count = 0, i, j;
+	uint64_t rx = 0, tx = 0, taken;
+
+	pthread_mutex_lock(&iface_lock);
+	cache = iface_snapshot(&iface_cache, true);
+	taken = cache->taken;
+	for (i = 0; i < cache->count && taken != traffic.taken; i++) {
+		const struct IfaceEntry *entry = &cache->entries[i];
+
+		if (!entry->has_bytes || (config->interface != NULL ?
+		    strcmp(entry->name, config->interface) != 0 :
+		    (entry->flags & IFF_LOOPBACK) != 0))
+			continue;
+		// The snapshot keeps the order of getifaddrs(), so the
+		// interface is usually at the same position as last time
+		for (j = 0; j < prev_count; j++) {
+			if (strcmp(prev[(count + j) % prev_count].name,
+			    entry->name) == 0)
+				break;
+		}
+		if (j < prev_count) {
+			j = (count + j) % prev_count;
+			rx += traffic_delta(prev[j].rx, entry->rx, entry->bits);
+			tx += traffic_delta(prev[j].tx, entry->tx, entry->bits);
+		}
+		strlcpy(cur[count].name, entry->name, sizeof(cur[count].name));
+		cur[count].rx = entry->rx;
+		cur[count].tx = entry->tx;
+		count++;
+	}
+	pthread_mutex_unlock(&iface_lock);
+
+	// A snapshot shared with the previous sample measures nothing, and
+	// the first sample only sets the counters
+	if (taken == traffic.taken)
+		return;
+	module_publish_begin(MOD_TRAFFIC);
+	if (traffic.taken != 0) {
+		traffic.rx_rate = (double)rx * NSEC_PER_SEC /
+		    (taken - traffic.taken);
+		traffic.tx_rate = (double)tx * NSEC_PER_SEC /
+		    (taken - traffic.taken);
+		history_push(HIST_RX, traffic.rx_rate);
+		history_push(HIST_TX, traffic.tx_rate);
+	}
+	module_publish_end(MOD_TRAFFIC);
+	traffic.taken = taken;
+	traffic.count[traffic.current ^ 1] = count;
+	traffic.current ^= 1;
+}
+
+// Update system load averages
+void
+update_system_load(double *load_avg)
+{
+	double load[3]; // Take 1, 5, and 15-minute load averages
+
+	if (!platform_load(load)) {
+		fprintf(stderr, "Error: Failed to get load averages\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < 3; i++) {
+		load_avg[i] = load[i];
+	}
+}
+
+// Return the entry for the configured sensor. The name is either a full
+// "device.tempN" key or a device name, which selects its first
+// temperature sensor. Without a configured name, CPU sensors are
+// preferred over ACPI thermal zones and then over any other sensor.
+static int
+sensor_select(const struct SensorCache *cache, const char *wanted)
+{
+	static const char *preferred[] = {"cpu", "x86_pkg_temp", "k10temp",
+		"acpitz", "km", NULL};
+	size_t length;
+	int i, p;
+
+	if (wanted != NULL) {
+		length = strlen(wanted);
+		for (i = 0; i < cache->count; i++) {
+			const char *name = cache->entries[i].name;
+
+			if (strcmp(name, wanted) == 0 ||
+			    (strncmp(name, wanted, length) == 0 &&
+			    name[length] == '.'))
+				return i;
+		}
+		return -1;
+	}
+
+	for (p = 0; preferred[p] != NULL; p++) {
+		length = strlen(preferred[p]);
+		for (i = 0; i < cache->count; i++) {
+			if (strncmp(cache->entries[i].name, preferred[p],
+			    length) == 0)
+				return i;
+		}
+	}
+	return cache->count > 0 ? 0 : -1;
+}
+
+// Rebuild the sensor table and select the configured sensor
+static void
+sensor_scan(struct SensorCache *cache, const char *wanted)
+{
+	platform_sensor_scan(cache);
+	cache->selected = sensor_select(cache, wanted);
+	cache->scanned = true;
+}
+
+// Read the selected sensor in degrees Celsius
+static bool
+sensor_read(const struct SensorCache *cache, int *celsius)
+{
+	return platform_sensor_read(&cache->entries[cache->selected], celsius);
+}
+
+// Read the CPU temperature from the cached sensor table. The sensor
+// tree is only scanned again on a hotplug hint: the selected sensor
+// failing to read, or a new sensor device appearing while none is
+// selected.
+static bool
+cpu_temp_read(const struct Config *config, int *temp)
+{
+	if (!sensor_cache.scanned ||
+	    (sensor_cache.selected == -1 &&
+	    platform_sensor_hotplug(&sensor_cache)))
+		sensor_scan(&sensor_cache, config->sensor);
+
+	if (sensor_cache.selected == -1)
+		return false;
+	if (sensor_read(&sensor_cache, temp))
+		return true;
+	sensor_scan(&sensor_cache, config->sensor);
+	return sensor_cache.selected != -1 && sensor_read(&sensor_cache, temp);
+}
+
+// Update the CPU speed and temperature, and publish both together
+void
+update_cpu(const struct Config *config)
+{
+	char speed[32];
+	int mhz, temp;
+	bool has_speed, has_temp;
+
+	has_temp = cpu_temp_read(config, &temp);
+	has_speed = platform_cpu_speed(&mhz);
+	if (has_speed)
+		snprintf(speed, sizeof(speed), "%4dMhz", mhz);
+	else
+		fprintf(stderr, "Error: Failed to get CPU average speed\n");
+
+	module_publish_begin(MOD_CPU);
+	if (has_speed)
+		strlcpy(cpu_avg_speed, speed, sizeof(cpu_avg_speed));
+	// If no valid temperature reading found, set to "x"
+	// specially for VMs
+	if (has_temp) {
+		snprintf(cpu_temp, sizeof(cpu_temp), "%d C", temp);
+		history_push(HIST_TEMP, temp);
+	} else {
+		snprintf(cpu_temp, sizeof(cpu_temp), "x");
+	}
+	module_publish_end(MOD_CPU);
+}
+
+// Fold a battery reading into the rate of charge and return the
+// estimated seconds until the battery is empty (on battery) or full (on
+// AC), or -1 when there is no estimate yet
+static long
+battery_estimate(struct BatteryRate *br, const struct PowerInfo *info,
+    uint64_t now)
+{
+	double elapsed, rate;
+
+	if (!br->sampled || info->ac_state != br->ac_state) {
+		br->sampled = true;
+		br->ac_state = info->ac_state;
+		br->percent = info->percent;
+		br->since = now;
+		br->anchored = false;
+		br->rate = 0;
+		return -1;
+	}
+
+	elapsed = (double)(now - br->since) / NSEC_PER_SEC;
+	if (info->percent != br->percent) {
+		// The first change after a reset only marks the start of a
+		// whole step
+		if (br->anchored && elapsed > 0) {
+			rate = (info->percent - br->percent) / elapsed;
+			br->rate = br->rate == 0 ? rate :
+			    BAT_EWMA_ALPHA * rate +
+			    (1 - BAT_EWMA_ALPHA) * br->rate;
+		}
+		br->anchored = true;
+		br->percent = info->percent;
+		br->since = now;
+		elapsed = 0;
+	}
+
+	// A level that holds longer than the average step slows the
+	// estimate down until it changes
+	rate = br->rate < 0 ? -br->rate : br->rate;
+	if (elapsed > 0 && rate > 1 / elapsed)
+		rate = 1 / elapsed;
+	if (rate == 0)
+		return -1;
+	if (br->rate < 0 && info->ac_state != POWER_AC_ONLINE)
+		return (long)(info->percent / rate);
+	if (br->rate > 0 && info->ac_state != POWER_AC_OFFLINE)
+		return (long)((100 - info->percent) / rate);
+	return -1;
+}
+
+// Return whether power events are of any use: to update the battery
+// module, or to stretch the intervals when the AC adapter is unplugged
+static bool
+power_watched(const struct Config *config)
+{
+	return config->show_bat || config->battery_stretch > 1;
+}
+
+// Read the power source for the refresh policy when the battery module
+// is not there to do it
+static void
+power_source_read(void)
+{
+	struct PowerInfo info;
+
+	if (platform_power(&info))
+		__atomic_store_n(&on_battery,
+		    info.ac_state == POWER_AC_OFFLINE, __ATOMIC_RELAXED);
+}
+
+// Update battery information from the platform backend
+void
+update_battery()
+{
+	struct PowerInfo info;
+	bool known;
+	long seconds = -1;
+
+	known = platform_power(&info) && info.percent >= 0;
+	if (known) {
+		seconds = battery_estimate(&battery_rate, &info,
+		    monotonic_ns());
+		__atomic_store_n(&on_battery,
+		    info.ac_state == POWER_AC_OFFLINE, __ATOMIC_RELAXED);
+	}
+
+	module_publish_begin(MOD_BAT);
+	if (known) {
+		snprintf(battery_percent, sizeof(battery_percent), "%d%%",
+		    info.percent);
+		history_push(HIST_BAT, info.percent);
+	} else {
+		strlcpy(battery_percent, "N/A", sizeof(battery_percent));
+	}
+	switch (known ? info.ac_state : POWER_AC_UNKNOWN) {
+	case POWER_AC_ONLINE:
+		strlcpy(battery_ac, "AC", sizeof(battery_ac));
+		break;
+	case POWER_AC_OFFLINE:
+		strlcpy(battery_ac, "BAT", sizeof(battery_ac));
+		break;
+	default:
+		strlcpy(battery_ac, "N/A", sizeof(battery_ac));
+		break;
+	}
+	if (seconds >= 0 && seconds < 100 * 3600)
+		snprintf(battery_time, sizeof(battery_time), "%ld:%02ld",
+		    seconds / 3600, seconds / 60 % 60);
+	else
+		strlcpy(battery_time, "--:--", sizeof(battery_time));
+	module_publish_end(MOD_BAT);
+}
+
+// Update date and time information
+void
+update_datetime()
+{
+	char text[sizeof(datetime)];
+	time_t rawtime;
+	struct tm timeinfo;
+	time(&rawtime);
+	localtime_r(&rawtime, &timeinfo);
+	strftime(text, sizeof(text), "%a %d %b %H:%M", &timeinfo);
+
+	module_publish_begin(MOD_DATE);
+	strlcpy(datetime, text, sizeof(datetime));
+	module_publish_end(MOD_DATE);
+}
+
+// Return whether a font name is a fontconfig pattern for xft rather
+// than a core font name: it starts with "xft:", or it has fontconfig
+// properties such as "DejaVu Sans Mono:size=10" and is not an XLFD
+static bool
+font_is_pattern(const char *name)
+{
+	return strncmp(name, "xft:", 4) == 0 ||
+	    (name[0] != '-' && strchr(name, ':') != NULL);
+}
+
+// Release the font of the bar, whichever backend loaded it
+static void
+free_font(struct Bar *bar)
+{
+	if (bar->xft != NULL) {
+		XftFontClose(bar->display, bar->xft);
+		bar->xft = NULL;
+	}
+	if (bar->font != NULL) {
+		XFreeFont(bar->display, bar->font);
+		bar->font = NULL;
+	}
+}
+
+// Load the font of the bar, replacing the current one. Fontconfig
+// patterns go through xft, other names are core fonts set on the GC.
+// Returns false, keeping the current font, if it cannot be loaded.
+static bool
+load_font(struct Bar *bar, const char *name)
+{
+	Display *display = bar->display;
+	XFontStruct *font;
+	XftFont *xft;
+
+	if (font_is_pattern(name)) {
+		if (strncmp(name, "xft:", 4) == 0)
+			name += 4;
+		xft = XftFontOpenName(display, DefaultScreen(display), name);
+		if (xft == NULL)
+			return false;
+		free_font(bar);
+		bar->xft = xft;
+		bar->baseline =
+		    (bar->height + xft->ascent - xft->descent) / 2;
+		return true;
+	}
+
+	font = XLoadQueryFont(display, name);
+	if (font == NULL)
+		return false;
+	free_font(bar);
+	bar->font = font;
+	bar->baseline = BAR_BASELINE;
+	XSetFont(display, bar->gc, font->fid);
+	return true;
+}
+
+// Set the text color of the bar. The GC color serves core fonts and
+// the xft color serves xft fonts; both are kept so that a reload can
+// switch between them.
+static void
+set_text_color(struct Bar *bar, const char *name)
+{
+	Display *display = bar->display;
+	int screen = DefaultScreen(display);
+	XftColor color;
+
+	if (!XftColorAllocName(display, DefaultVisual(display, screen),
+	    DefaultColormap(display, screen), name, &color))
+		return;
+	if (bar->has_xft_color)
+		XftColorFree(display, DefaultVisual(display, screen),
+		    DefaultColormap(display, screen), &bar->xft_color);
+	bar->xft_color = color;
+	bar->has_xft_color = true;
+	XSetForeground(display, bar->gc, color.pixel);
+}
+
+// Return the width in pixels of a run of text in the bar font
+static int
+text_width(const struct Bar *bar, const char *text, size_t length)
+{
+	XGlyphInfo extents;
+
+	if (bar->xft == NULL)
+		return XTextWidth(bar->font, text, length);
+	XftTextExtentsUtf8(bar->display, bar->xft, (const FcChar8 *)text,
+	    length, &extents);
+	return extents.xOff;
+}
+
+// Draw a run of text into the back buffer
+static void
+draw_text(struct Bar *bar, int x, const char *text, size_t length)
+{
+	if (bar->xft == NULL)
+		XDrawString(bar->display, bar->buffer, bar->gc, x,
+		    bar->baseline, text, length);
+	else
+		XftDrawStringUtf8(bar->draw, &bar->xft_color, bar->xft, x,
+		    bar->baseline, (const FcChar8 *)text, length);
+}
+
+// Draw a sparkline segment, one U+2581..U+2588 block character per
+// sample, as SPARK_WIDTH pixel wide bars rising from the bottom of the
+// bar, all sent with a single XFillRectangles request
+static void
+draw_sparkline(struct Bar *bar, int x, const char *text, size_t length)
+{
+	XRectangle rects[HISTORY_MAX];
+	int n, level, height, span = bar->height - 2 * SPARK_MARGIN;
+
+	for (n = 0; n < HISTORY_MAX && (size_t)n * 3 + 2 < length; n++) {
+		level = (unsigned char)text[n * 3 + 2] - 0x80;
+		height = span * level / 8;
+		rects[n].x = x + n * SPARK_WIDTH;
+		rects[n].y = bar->height - SPARK_MARGIN - height;
+		rects[n].width = SPARK_WIDTH - 1;
+		rects[n].height = height;
+	}
+	XFillRectangles(bar->display, bar->buffer, bar->gc, rects, n);
+}
+
+// (Re)create the back buffer to match the size of the bar window and
+// fill it with the background color
+void
+resize_buffer(struct Bar *bar, int width, int height)
+{
+	Display *display = bar->display;
+
+	if (bar->buffer != None)
+		XFreePixmap(display, bar->buffer);
+	bar->width = width;
+	bar->height = height;
+	bar->buffer = XCreatePixmap(display, bar->window, width, height,
+	    DefaultDepth(display, DefaultScreen(display)));
+	XFillRectangle(display, bar->buffer, bar->clear_gc, 0, 0, width,
+	    height);
+	if (bar->draw != NULL)
+		XftDrawChange(bar->draw, bar->buffer);
+	if (bar->xft != NULL)
+		bar->baseline =
+		    (height + bar->xft->ascent - bar->xft->descent) / 2;
+}
+
+// Copy a rectangle of the back buffer to the window
+void
+present_buffer(struct Bar *bar, int x, int y, int width, int height)
+{
+	XCopyArea(bar->display, bar->buffer, bar->window, bar->gc, x, y,
+	    width, height, x, y);
+}
+
+// Create an Xlib window for displaying the status bar
+void
+create_window(struct Bar *bar, Display *display, int screen,
+    const struct Config *config, const struct Output *output)
+{
+	int window_width = output->width;
+	int window_height = BAR_HEIGHT; // Fixed height for the bar
+	Window *window = &bar->window;
+	GC *gc = &bar->gc;
+
+	memset(bar, 0, sizeof(*bar));
+	bar->display = display;
+	bar->output = output->id;
+	bar->width = window_width;
+	bar->height = window_height;
+
+	*window = XCreateSimpleWindow(display, RootWindow(display, screen),
+	    output->x, output->y, window_width, window_height, 1,
+	    BlackPixel(display, screen), WhitePixel(display, screen));
+
+	// Track the window size through ConfigureNotify instead of querying
+	// the server on every frame, and whether it can be seen at all
+	// through VisibilityNotify
+	XSelectInput(display, *window, ExposureMask | KeyPressMask |
+	    StructureNotifyMask | VisibilityChangeMask);
+	XMapWindow(display, *window);
+
+	// Set window properties to make it unmanaged and always on top
+	Atom wm_state = XInternAtom(display, "_NET_WM_STATE", False);
+	Atom wm_state_above =
+	    XInternAtom(display, "_NET_WM_STATE_ABOVE", False);
+	Atom wm_bypass_wm =
+	    XInternAtom(display, "_NET_WM_BYPASS_COMPOSITOR", False);
+	Atom wm_state_skip_taskbar =
+	    XInternAtom(display, "_NET_WM_STATE_SKIP_TASKBAR", False);
+	Atom wm_state_skip_pager =
+	    XInternAtom(display, "_NET_WM_STATE_SKIP_PAGER", False);
+	Atom wm_state_sticky =
+	    XInternAtom(display, "_NET_WM_STATE_STICKY", False);
+	XMoveWindow(display, *window, output->x, output->y);
+
+	Atom wm_state_atoms[] = {wm_state_above, wm_bypass_wm,
+		wm_state_skip_taskbar, wm_state_skip_pager, wm_state_sticky};
+	XChangeProperty(display, *window, wm_state, XA_ATOM, 32,
+	    PropModeReplace, (unsigned char *)wm_state_atoms, 5);
+
+	*gc = XCreateGC(display, *window, 0, NULL);
+	if (*gc == NULL) {
+		fprintf(stderr, "Cannot create graphics context\n");
+		exit(1);
+	}
+
+	// Load the font. It stays loaded for the lifetime of the bar so
+	// text can be measured without round trips.
+	if (!load_font(bar, config->font != NULL ? config->font : "fixed") &&
+	    !load_font(bar, "fixed")) {
+		fprintf(stderr, "Error: Failed to load font\n");
+		XFreeGC(display, *gc);
+		XCloseDisplay(display);
+		exit(1);
+	}
+
+	Colormap colormap = DefaultColormap(display, screen);
+	XColor bg;
+	unsigned long bg_pixel = WhitePixel(display, screen);
+
+	XSetForeground(display, *gc, BlackPixel(display, screen));
+	if (config->foreground != NULL)
+		set_text_color(bar, config->foreground);
+	if (config->background != NULL &&
+	    XAllocNamedColor(display, colormap, config->background, &bg, &bg)) {
+		bg_pixel = bg.pixel;
+	}
+
+	XSetBackground(display, *gc, bg_pixel);
+
+	// Frames are rendered into an off-screen back buffer and copied to
+	// the window, so the window itself has no background: the server
+	// never clears it to a blank frame before the copy
+	bar->clear_gc = XCreateGC(display, *window, 0, NULL);
+	XSetForeground(display, bar->clear_gc, bg_pixel);
+	XSetWindowBackgroundPixmap(display, *window, None);
+	bar->buffer = None;
+	resize_buffer(bar, window_width, window_height);
+	bar->draw = XftDrawCreate(display, bar->buffer,
+	    DefaultVisual(display, screen), colormap);
+	XMapRaised(display, *window);
+}
+
+// Release the X resources of the status bar
+void
+destroy_window(struct Bar *bar)
+{
+	Display *display = bar->display;
+	int screen = DefaultScreen(display);
+
+	if (bar->draw != NULL)
+		XftDrawDestroy(bar->draw);
+	if (bar->has_xft_color)
+		XftColorFree(display, DefaultVisual(display, screen),
+		    DefaultColormap(display, screen), &bar->xft_color);
+	free_font(bar);
+	XFreePixmap(display, bar->buffer);
+	XFreeGC(display, bar->clear_gc);
+	XFreeGC(display, bar->gc);
+	XDestroyWindow(display, bar->window);
+}
+
+// Apply the font and colors of a reloaded configuration to the bar.
+// Only those that changed are loaded; the window and GCs are kept.
+void
+restyle_window(struct Bar *bar, const struct Config *old,
+    const struct Config *config)
+{
+	Display *display = bar->display;
+	Colormap colormap = DefaultColormap(display, DefaultScreen(display));
+	XColor color;
+
+	if (strcmp(old->font, config->font) != 0 &&
+	    !load_font(bar, config->font))
+		fprintf(stderr, "Error: Failed to load font %s\n",
+		    config->font);
+	if (strcmp(old->foreground, config->foreground) != 0)
+		set_text_color(bar, config->foreground);
+	if (strcmp(old->background, config->background) != 0 &&
+	    XAllocNamedColor(display, colormap, config->background, &color,
+	    &color)) {
+		XSetBackground(display, bar->gc, color.pixel);
+		XSetForeground(display, bar->clear_gc, color.pixel);
+	}
+}
+
+// Lay out the segments centered on the bar and render those whose text
+// or position changed into the back buffer. Each repainted segment is
+// cleared over its old and new rectangles only, and the damaged span is
+// then presented with a single XCopyArea. Nothing is sent to the server
+// when no segment changed. A full render measures and redraws every
+// segment. Dirty flags are left for the caller to clear once every bar
+// is drawn.
+void
+draw_segments(struct Bar *bar, const struct Segment *segments, int count,
+    bool full)
+{
+	Display *display = bar->display;
+	bool damaged[FORMAT_MAX_OPS];
+	int id, x, total_width = 0;
+	int damage_start = bar->width, damage_end = 0;
+
+	for (id = 0; id < count; id++) {
+		if (segments[id].dirty)
+			break;
+	}
+	if (id == count && !full)
+		return;
+
+	// Measure the segments whose text changed with the cached font
+	for (id = 0; id < count; id++) {
+		struct SegmentLayout *layout = &bar->layout[id];
+
+		if (segments[id].graph)
+			layout->width = segments[id].length / 3 * SPARK_WIDTH;
+		else if (full || segments[id].dirty)
+			layout->width = text_width(
+			    bar, segments[id].text, segments[id].length);
+		total_width += layout->width;
+	}
+
+	if (full) {
+		XFillRectangle(display, bar->buffer, bar->clear_gc, 0, 0,
+		    bar->width, bar->height);
+		damage_start = 0;
+		damage_end = bar->width;
+	}
+
+	// Center the line and clear the old and new rectangles of every
+	// segment that changed or moved, before anything is drawn
+	x = (bar->width - total_width) / 2;
+	for (id = 0; id < count; id++) {
+		struct SegmentLayout *layout = &bar->layout[id];
+
+		bool moved = segments[id].dirty || layout->x != x ||
+		    layout->width != layout->painted_width;
+
+		damaged[id] = full || moved;
+		if (moved && !full) {
+			int start = x < layout->x ? x : layout->x;
+			int end = x + layout->width;
+
+			if (layout->x + layout->painted_width > end)
+				end = layout->x + layout->painted_width;
+			if (layout->painted_width > 0)
+				XFillRectangle(display, bar->buffer,
+				    bar->clear_gc, layout->x, 0,
+				    layout->painted_width, bar->height);
+			if (layout->width > 0)
+				XFillRectangle(display, bar->buffer,
+				    bar->clear_gc, x, 0, layout->width,
+				    bar->height);
+			if (start < damage_start)
+				damage_start = start;
+			if (end > damage_end)
+				damage_end = end;
+		}
+		layout->x = x;
+		x += layout->width;
+	}
+
+	for (id = 0; id < count; id++) {
+		struct SegmentLayout *layout = &bar->layout[id];
+
+		if (!damaged[id] || segments[id].length == 0)
+			;
+		else if (segments[id].graph)
+			draw_sparkline(bar, layout->x, segments[id].text,
+			    segments[id].length);
+		else
+			draw_text(bar, layout->x, segments[id].text,
+			    segments[id].length);
+		layout->painted_width = layout->width;
+	}
+
+	// Present the damaged span and flush the display to ensure all
+	// commands are sent
+	if (damage_start < 0)
+		damage_start = 0;
+	if (damage_end > bar->width)
+		damage_end = bar->width;
+	if (damage_end > damage_start)
+		present_buffer(bar, damage_start, 0, damage_end - damage_start,
+		    bar->height);
+	XFlush(display);
+}
+
+// Return the geometry of every active monitor, from RandR when it is
+// available. Mirrored outputs share one bar. Without RandR, or without
+// an active output, the whole screen is a single output.
+static int
+query_outputs(Display *display, struct Output *outputs, int max)
+{
+	int screen = DefaultScreen(display);
+	int count = 0;
+
+#ifdef HAVE_XRANDR
+	XRRScreenResources *res;
+	int i, j;
+
+	res = XRRGetScreenResourcesCurrent(display,
+	    RootWindow(display, screen));
+	for (i = 0; res != NULL && i < res->noutput && count < max; i++) {
+		XRROutputInfo *info;
+		XRRCrtcInfo *crtc;
+
+		info = XRRGetOutputInfo(display, res, res->outputs[i]);
+		if (info == NULL)
+			continue;
+		if (info->connection != RR_Connected || info->crtc == None) {
+			XRRFreeOutputInfo(info);
+			continue;
+		}
+		crtc = XRRGetCrtcInfo(display, res, info->crtc);
+		XRRFreeOutputInfo(info);
+		if (crtc == NULL)
+			continue;
+		for (j = 0; j < count; j++) {
+			if (outputs[j].x == crtc->x &&
+			    outputs[j].y == crtc->y &&
+			    outputs[j].width == (int)crtc->width)
+				break;
+		}
+		if (j == count && crtc->width > 0) {
+			outputs[count].id = res->outputs[i];
+			outputs[count].x = crtc->x;
+			outputs[count].y = crtc->y;
+			outputs[count].width = crtc->width;
+			count++;
+		}
+		XRRFreeCrtcInfo(crtc);
+	}
+	if (res != NULL)
+		XRRFreeScreenResources(res);
+#else
+	(void)max;
+#endif
+
+	if (count == 0) {
+		outputs[0].id = None;
+		outputs[0].x = 0;
+		outputs[0].y = 0;
+		outputs[0].width = DisplayWidth(display, screen);
+		count = 1;
+	}
+	return count;
+}
+
+// Bring the bars in line with the active outputs: bars of outputs that
+// went away are destroyed, bars of outputs that moved or were resized
+// follow them, and new outputs get a bar. Returns whether any bar
+// changed and needs a full render.
+static bool
+bars_update(struct Bars *bars, const struct Config *config)
+{
+	struct Output outputs[BAR_MAX];
+	bool changed = false;
+	int count, i, j;
+
+	count = query_outputs(bars->display, outputs, BAR_MAX);
+
+	for (i = 0; i < bars->count;) {
+		for (j = 0; j < count; j++) {
+			if (outputs[j].id == bars->bar[i].output)
+				break;
+		}
+		if (j < count) {
+			i++;
+			continue;
+		}
+		destroy_window(&bars->bar[i]);
+		bars->bar[i] = bars->bar[--bars->count];
+		changed = true;
+	}
+
+	for (j = 0; j < count; j++) {
+		struct Bar *bar = NULL;
+
+		for (i = 0; i < bars->count; i++) {
+			if (bars->bar[i].output == outputs[j].id)
+				bar = &bars->bar[i];
+		}
+		if (bar == NULL) {
+			create_window(&bars->bar[bars->count++], bars->display,
+			    DefaultScreen(bars->display), config, &outputs[j]);
+			changed = true;
+			continue;
+		}
+		XMoveResizeWindow(bars->display, bar->window, outputs[j].x,
+		    outputs[j].y, outputs[j].width, bar->height);
+		if (bar->width != outputs[j].width) {
+			resize_buffer(bar, outputs[j].width, bar->height);
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+// Create a bar on every active output and watch for monitor changes
+static void
+bars_open(struct Bars *bars, Display *display, const struct Config *config)
+{
+	bars->display = display;
+	bars->count = 0;
+	bars->randr_event = -1;
+	bars->saver_event = -1;
+	bars->saver_on = false;
+	bars->dpms = false;
+	bars->dpms_off = false;
+	bars->dpms_checked = 0;
+
+#ifdef HAVE_XRANDR
+	int error_base;
+
+	if (XRRQueryExtension(display, &bars->randr_event, &error_base))
+		XRRSelectInput(display, DefaultRootWindow(display),
+		    RRScreenChangeNotifyMask | RROutputChangeNotifyMask |
+		    RRCrtcChangeNotifyMask);
+	else
+		bars->randr_event = -1;
+#endif
+#ifdef HAVE_XSS
+	int dummy;
+
+	if (XScreenSaverQueryExtension(display, &bars->saver_event, &dummy))
+		XScreenSaverSelectInput(display, DefaultRootWindow(display),
+		    ScreenSaverNotifyMask);
+	else
+		bars->saver_event = -1;
+	bars->dpms = DPMSQueryExtension(display, &dummy, &dummy) &&
+	    DPMSCapable(display);
+#endif
+
+	bars_update(bars, config);
+}
+
+// Return whether an X event reports the screen saver starting or
+// stopping, and note which
+static bool
+bars_saver_event(struct Bars *bars, XEvent *event)
+{
+#ifdef HAVE_XSS
+	if (bars->saver_event == -1 ||
+	    event->type != bars->saver_event + ScreenSaverNotify)
+		return false;
+	bars->saver_on =
+	    ((XScreenSaverNotifyEvent *)event)->state == ScreenSaverOn;
+	return true;
+#else
+	(void)bars;
+	(void)event;
+	return false;
+#endif
+}
+
+// Ask whether DPMS turned the monitors off. DPMS reports no events, so
+// this is asked on timer wakeups, but at most every BLANK_RECHECK: it
+// costs a round trip to the server, which the ticks otherwise avoid.
+static void
+bars_poll_dpms(struct Bars *bars, uint64_t now)
+{
+#ifdef HAVE_XSS
+	CARD16 level;
+	BOOL enabled;
+
+	if (!bars->dpms || now - bars->dpms_checked < BLANK_RECHECK)
+		return;
+	bars->dpms_checked = now;
+	if (DPMSInfo(bars->display, &level, &enabled))
+		bars->dpms_off = enabled && level != DPMSModeOn;
+#else
+	(void)bars;
+	(void)now;
+#endif
+}
+
+// Return whether nothing the bars show can be seen: every bar is fully
+// obscured, or the screen is blanked
+static bool
+bars_hidden(const struct Bars *bars)
+{
+	int i;
+
+	if (bars->saver_on || bars->dpms_off)
+		return true;
+	for (i = 0; i < bars->count; i++) {
+		if (!bars->bar[i].obscured)
+			return false;
+	}
+	return bars->count > 0;
+}
+
+// Return whether an X event reports a change of the monitor layout
+static bool
+bars_randr_event(struct Bars *bars, XEvent *event)
+{
+#ifdef HAVE_XRANDR
+	if (bars->randr_event == -1)
+		return false;
+	if (event->type == bars->randr_event + RRScreenChangeNotify) {
+		XRRUpdateConfiguration(event);
+		return true;
+	}
+	return event->type == bars->randr_event + RRNotify;
+#else
+	(void)bars;
+	(void)event;
+	return false;
+#endif
+}
+
+// Return the bar owning a window, or NULL
+static struct Bar *
+bars_find(struct Bars *bars, Window window)
+{
+	int i;
+
+	for (i = 0; i < bars->count; i++) {
+		if (bars->bar[i].window == window)
+			return &bars->bar[i];
+	}
+	return NULL;
+}
+
+// Render the segments on every bar, then mark them clean. N bars cost
+// N blits; the segments were sampled and formatted once.
+static void
+bars_draw(struct Bars *bars, struct Segment *segments, int count, bool full)
+{
+	int i;
+
+	for (i = 0; i < bars->count; i++)
+		draw_segments(&bars->bar[i], segments, count, full);
+	for (i = 0; i < count; i++)
+		segments[i].dirty = false;
+}
+
+// Destroy every bar
+static void
+bars_close(struct Bars *bars)
+{
+	int i;
+
+	for (i = 0; i < bars->count; i++)
+		destroy_window(&bars->bar[i]);
+	bars->count = 0;
+}
+
+// Return whether a module is enabled in the configuration
+static bool
+module_enabled(const struct Config *config, int id)
+{
+	switch (id) {
+	case MOD_HOSTNAME:
+		return config->show_hostname;
+	case MOD_DATE:
+		return config->show_date;
+	case MOD_CPU:
+		return config->show_cpu;
+	case MOD_MEM:
+		return config->show_mem;
+	case MOD_LOAD:
+		return config->show_load;
+	case MOD_BAT:
+		return config->show_bat;
+	case MOD_VPN:
+		return config->show_vpn;
+	case MOD_NET:
+		return config->show_net;
+	case MOD_USAGE:
+		return config->show_usage;
+	case MOD_TRAFFIC:
+		return config->show_traffic;
+	default:
+		return false;
+	}
+}
+
+// Return whether a module is sampled on routing socket notifications
+// rather than on its interval
+static bool
+module_event_driven(int id)
+{
+	return (id == MOD_VPN || id == MOD_NET) && iface_cache.route_fd != -1;
+}
+
+// Sample a single module and publish its values
+static void
+module_update(const struct Config *config, int id)
+{
+	uint64_t start = monotonic_ns();
+	unsigned long long memory;
+	double load[3];
+
+	switch (id) {
+	case MOD_HOSTNAME:
+		update_hostname();
+		break;
+	case MOD_DATE:
+		update_datetime();
+		break;
+	case MOD_CPU:
+		update_cpu(config);
+		break;
+	case MOD_MEM:
+		memory = update_mem();
+		module_publish_begin(id);
+		free_memory = memory;
+		history_push(HIST_MEM, memory);
+		module_publish_end(id);
+		break;
+	case MOD_LOAD:
+		update_system_load(load);
+		module_publish_begin(id);
+		memcpy(system_load, load, sizeof(system_load));
+		history_push(HIST_LOAD, load[0]);
+		module_publish_end(id);
+		break;
+	case MOD_BAT:
+		update_battery();
+		break;
+	case MOD_VPN:
+		update_vpn();
+		break;
+	case MOD_NET:
+		update_internal_ip(*config);
+		break;
+	case MOD_USAGE:
+		update_cpu_usage();
+		break;
+	case MOD_TRAFFIC:
+		update_traffic(config);
+		break;
+	}
+	stat_record(id, monotonic_ns() - start);
+}
+
+// Run queued collectors until the pool is stopped
+static void *
+pool_worker(void *arg)
+{
+	const char byte = 0;
+	int id;
+
+	(void)arg;
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (pool.count == 0 && !pool.stop)
+			pthread_cond_wait(&pool.work, &pool.lock);
+		if (pool.stop)
+			break;
+		id = pool.queue[pool.head];
+		pool.head = (pool.head + 1) % MOD_COUNT;
+		pool.count--;
+		pool.running++;
+		pthread_mutex_unlock(&pool.lock);
+
+		module_update(pool.config, id);
+		// A full pipe already has a wakeup pending
+		(void)write(pool.notify[1], &byte, 1);
+
+		pthread_mutex_lock(&pool.lock);
+		pool.pending[id] = false;
+		pool.running--;
+		if (pool.count == 0 && pool.running == 0)
+			pthread_cond_broadcast(&pool.idle);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+// Start the worker threads with every signal blocked, so that signals
+// keep interrupting the poll(2) of the main thread. Returns the read
+// end of the notification pipe, or -1.
+static int
+pool_start(const struct Config *config)
+{
+	sigset_t all, saved;
+	int i;
+
+	if (pipe(pool.notify) == -1)
+		return -1;
+	for (i = 0; i < 2; i++) {
+		fcntl(pool.notify[i], F_SETFD, FD_CLOEXEC);
+		fcntl(pool.notify[i], F_SETFL, O_NONBLOCK);
+	}
+	pool.config = config;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+	for (i = 0; i < POOL_WORKERS; i++) {
+		if (pthread_create(&pool.threads[i], NULL, pool_worker, NULL) !=
+		    0)
+			break;
+		pool.started++;
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	if (pool.started == 0) {
+		close(pool.notify[0]);
+		close(pool.notify[1]);
+		return -1;
+	}
+	return pool.notify[0];
+}
+
+// Queue a module for the workers unless it is already queued or running
+static void
+pool_submit(int id)
+{
+	pthread_mutex_lock(&pool.lock);
+	if (!pool.pending[id]) {
+		pool.queue[(pool.head + pool.count) % MOD_COUNT] = id;
+		pool.count++;
+		pool.pending[id] = true;
+		pthread_cond_signal(&pool.work);
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+// Wait until every queued and running collector has finished, before
+// the configuration they read is replaced or freed
+static void
+pool_drain(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	while (pool.count > 0 || pool.running > 0)
+		pthread_cond_wait(&pool.idle, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+// Wait at most timeout nanoseconds for the queued and running
+// collectors to finish
+static void
+pool_wait(uint64_t timeout)
+{
+	struct timespec until;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += timeout / NSEC_PER_SEC;
+	until.tv_nsec += timeout % NSEC_PER_SEC;
+	if (until.tv_nsec >= (long)NSEC_PER_SEC) {
+		until.tv_sec++;
+		until.tv_nsec -= NSEC_PER_SEC;
+	}
+	pthread_mutex_lock(&pool.lock);
+	while (pool.count > 0 || pool.running > 0) {
+		if (pthread_cond_timedwait(&pool.idle, &pool.lock, &until) != 0)
+			break;
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+// Discard the pending notifications. Returns true if any job finished.
+static bool
+pool_notified(void)
+{
+	char buffer[64];
+	bool notified = false;
+
+	while (read(pool.notify[0], buffer, sizeof(buffer)) > 0)
+		notified = true;
+	return notified;
+}
+
+// Let the running collectors finish and join the workers
+static void
+pool_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = true;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+	for (i = 0; i < pool.started; i++)
+		pthread_join(pool.threads[i], NULL);
+	pool.started = 0;
+	close(pool.notify[0]);
+	close(pool.notify[1]);
+}
+
+// Sample a module on the worker pool, or right away on this thread
+// when the pool is not running
+static void
+module_sample(const struct Config *config, int id)
+{
+	if (pool.started > 0)
+		pool_submit(id);
+	else
+		module_update(config, id);
+}
+
+// Return the offset of the wall clock from the monotonic time now
+static int64_t
+wall_offset(uint64_t now)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)((uint64_t)ts.tv_sec * NSEC_PER_SEC +
+	    (uint64_t)ts.tv_nsec - now);
+}
+
+// Return the next deadline of a module after now. Wall-aligned modules
+// wake on the next wall-clock multiple of their interval, converted to
+// the monotonic clock; the others advance on their own monotonic grid.
+static uint64_t
+module_next_deadline(const struct Scheduler *sched, int id, uint64_t now)
+{
+	uint64_t interval = sched->interval[id];
+	struct timespec ts;
+	uint64_t wall;
+
+	if (!module_info[id].wall_aligned)
+		return tick_advance(sched->deadline[id],
+		    interval * sched->stretch, now);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	wall = (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+	return now + interval - wall % interval;
+}
+
+// Restore the heap property from position i towards the leaves
+static void
+sched_sift_down(struct Scheduler *sched, int i)
+{
+	for (;;) {
+		int left = 2 * i + 1, right = left + 1, min = i, tmp;
+
+		if (left < sched->count && sched->deadline[sched->heap[left]] <
+		    sched->deadline[sched->heap[min]])
+			min = left;
+		if (right < sched->count &&
+		    sched->deadline[sched->heap[right]] <
+		    sched->deadline[sched->heap[min]])
+			min = right;
+		if (min == i)
+			return;
+		tmp = sched->heap[i];
+		sched->heap[i] = sched->heap[min];
+		sched->heap[min] = tmp;
+		i = min;
+	}
+}
+
+// Insert a module into the heap, ordered by its deadline
+static void
+sched_push(struct Scheduler *sched, int id)
+{
+	int i = sched->count++;
+
+	sched->heap[i] = id;
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+
+		if (sched->deadline[sched->heap[parent]] <=
+		    sched->deadline[id])
+			break;
+		sched->heap[i] = sched->heap[parent];
+		sched->heap[parent] = id;
+		i = parent;
+	}
+}
+
+// Build the schedule of every enabled module; all of them are due now
+static void
+sched_init(struct Scheduler *sched, const struct Config *config,
+    uint64_t now)
+{
+	int id;
+
+	sched->count = 0;
+	sched->stretch = 1;
+	sched->wall_offset = wall_offset(now);
+	for (id = 0; id < MOD_COUNT; id++) {
+		sched->interval[id] =
+		    (uint64_t)config->interval[id] * NSEC_PER_SEC;
+		sched->deadline[id] = now;
+		if (module_enabled(config, id) && !module_event_driven(id))
+			sched_push(sched, id);
+	}
+}
+
+// Stretch the module intervals by a new factor. Each pending deadline
+// moves to the new interval after the sample that set it, so returning
+// to AC does not wait out a long battery interval.
+static void
+sched_stretch(struct Scheduler *sched, unsigned int stretch)
+{
+	int heap[MOD_COUNT];
+	int count = sched->count, i;
+
+	memcpy(heap, sched->heap, sizeof(heap));
+	sched->count = 0;
+	for (i = 0; i < count; i++) {
+		int id = heap[i];
+		uint64_t old = sched->interval[id] * sched->stretch;
+
+		if (!module_info[id].wall_aligned) {
+			sched->deadline[id] = (sched->deadline[id] > old ?
+			    sched->deadline[id] - old : 0) +
+			    sched->interval[id] * stretch;
+		}
+		sched_push(sched, id);
+	}
+	sched->stretch = stretch;
+}
+
+// Re-derive the deadlines of the wall-aligned modules if the wall clock
+// moved against the monotonic clock: it was set, or the system resumed
+// from a suspend the monotonic clock did not count. They fall due at
+// once. Returns whether any did.
+static bool
+sched_clock_check(struct Scheduler *sched, uint64_t now)
+{
+	int64_t offset = wall_offset(now), drift;
+	int heap[MOD_COUNT];
+	int count = sched->count, i;
+	bool due = false;
+
+	drift = offset - sched->wall_offset;
+	sched->wall_offset = offset;
+	if (drift < CLOCK_STEP && drift > -CLOCK_STEP)
+		return false;
+
+	memcpy(heap, sched->heap, sizeof(heap));
+	sched->count = 0;
+	for (i = 0; i < count; i++) {
+		if (module_info[heap[i]].wall_aligned) {
+			sched->deadline[heap[i]] = now;
+			due = true;
+		}
+		sched_push(sched, heap[i]);
+	}
+	return due;
+}
+
+// Sample the enabled event-driven modules after an interface change
+static void
+sched_run_events(const struct Config *config)
+{
+	int id;
 
-	if (getifaddrs(&ifap) == -1) {
-		perror("getifaddrs");
-		exit(EXIT_FAILURE);
+	for (id = 0; id < MOD_COUNT; id++) {
+		if (module_enabled(config, id) && module_event_driven(id))
+			module_sample(config, id);
 	}
-	// Check for wgX interfaces
-	for (ifa = ifap; ifa != NULL; ifa = ifa->ifa_next) {
-		if (strncmp(ifa->ifa_name, "wg", 2) == 0 &&
-		    ifa->ifa_flags & IFF_UP) {
-			has_wg_interface = 1;
+}
+
+// Return the earliest module deadline, or UINT64_MAX if none is enabled
+static uint64_t
+sched_next(const struct Scheduler *sched)
+{
+	return sched->count > 0 ? sched->deadline[sched->heap[0]] :
+	    UINT64_MAX;
+}
+
+// Sample every module that is due, along with the free-running modules
+// that would be due within SCHED_SLACK. Returns the number sampled or
+// queued.
+static int
+sched_run(struct Scheduler *sched, const struct Config *config,
+    uint64_t now)
+{
+	int sampled = 0;
+
+	while (sched->count > 0) {
+		int id = sched->heap[0];
+		uint64_t deadline = sched->deadline[id];
+
+		if (deadline > now &&
+		    (module_info[id].wall_aligned ||
+		    deadline > now + SCHED_SLACK))
 			break;
+		module_sample(config, id);
+		sampled++;
+		sched->deadline[id] = module_next_deadline(sched, id, now);
+		sched_sift_down(sched, 0);
+	}
+	return sampled;
+}
+
+// Return whether a reloaded configuration changes what a module samples
+static bool
+module_reconfigured(const struct Config *old, const struct Config *config,
+    int id)
+{
+	if (!module_enabled(old, id) ||
+	    old->interval[id] != config->interval[id])
+		return true;
+	switch (id) {
+	case MOD_CPU:
+		return config_changed(old->sensor, config->sensor);
+	case MOD_NET:
+		return config_changed(old->interface, config->interface);
+	default:
+		return false;
+	}
+}
+
+// Rebuild the schedule after a configuration reload. Modules that stay
+// enabled with the same settings keep their deadline; the others are
+// due now, and disabled modules leave the heap.
+static void
+sched_reconfigure(struct Scheduler *sched, const struct Config *old,
+    const struct Config *config, uint64_t now)
+{
+	int id;
+
+	sched->count = 0;
+	for (id = 0; id < MOD_COUNT; id++) {
+		if (!module_enabled(config, id))
+			continue;
+		if (module_reconfigured(old, config, id)) {
+			sched->interval[id] =
+			    (uint64_t)config->interval[id] * NSEC_PER_SEC;
+			sched->deadline[id] = now;
+			if (module_event_driven(id))
+				module_sample(config, id);
 		}
+		if (!module_event_driven(id))
+			sched_push(sched, id);
 	}
+}
 
-	freeifaddrs(ifap);
+// Build the classic layout from the enabled modules, for configurations
+// without a format= option
+static void
+default_format(const struct Config *config, char *buffer, size_t size)
+{
+	buffer[0] = '\0';
+	if (config->logo != NULL && config->logo[0] != '\0')
+		strlcat(buffer, "{logo}|", size);
+	if (config->show_hostname)
+		strlcat(buffer, " {hostname} |", size);
+	if (config->show_date)
+		strlcat(buffer, " {date} |", size);
+	if (config->show_cpu)
+		strlcat(buffer, " CPU: {cpu} ({temp}) |", size);
+	if (config->show_usage)
+		strlcat(buffer, " Usage: {usage}% |", size);
+	if (config->show_mem)
+		strlcat(buffer, " Mem: {mem} MB |", size);
+	if (config->show_load)
+		strlcat(buffer, " Load: {load} |", size);
+	if (config->show_bat)
+		strlcat(buffer, " Bat: {bat} {ac} {bat_time} |", size);
+	if (config->show_vpn)
+		strlcat(buffer, " {vpn} |", size);
+	if (config->show_traffic)
+		strlcat(buffer, " Rx: {rx} Tx: {tx} |", size);
+	if (config->show_net)
+		strlcat(buffer, " IPs: {ip} | {ipv6} ~ {lan} ", size);
+}
 
-	if (has_wg_interface)
-		snprintf(vpn_status, sizeof(vpn_status), "VPN");
-	else
-		snprintf(vpn_status, sizeof(vpn_status), "No VPN");
+// Append a literal run of text to the compiled format
+static bool
+format_literal(struct Format *format, const char *text, size_t length)
+{
+	struct FormatOp *op;
+
+	if (length == 0)
+		return true;
+	if (format->count == FORMAT_MAX_OPS ||
+	    format->literals_used + length > sizeof(format->literals))
+		return false;
+
+	op = &format->ops[format->count++];
+	memset(op, 0, sizeof(*op));
+	op->literal = true;
+	op->precision = -1;
+	op->text = format->literals + format->literals_used;
+	op->length = length;
+	memcpy(format->literals + format->literals_used, text, length);
+	format->literals_used += length;
+	return true;
 }
 
-// Update memory information by querying system statistics
-unsigned long long
-update_mem()
+// Parse a "{name[:[-]width][.precision]}" field reference starting after
+// the opening brace. Returns a pointer past the closing brace, or NULL.
+static const char *
+format_field(struct Format *format, const char *p)
 {
-	int mib[2] = {CTL_VM, VM_UVMEXP};
-	size_t len;
-	unsigned long long freemem;
+	struct FormatOp *op;
+	size_t length = strcspn(p, ":}");
+	char *end;
+	int i;
+
+	if (format->count == FORMAT_MAX_OPS)
+		return NULL;
+	op = &format->ops[format->count];
+	memset(op, 0, sizeof(*op));
+
+	for (i = 0; i < FIELD_COUNT; i++) {
+		if (strlen(field_info[i].name) == length &&
+		    strncmp(field_info[i].name, p, length) == 0)
+			break;
+	}
+	if (i == FIELD_COUNT)
+		return NULL;
+	op->field = i;
+	op->precision = field_info[i].precision;
+	p += length;
+
+	if (*p == ':') {
+		p++;
+		if (*p == '-') {
+			op->left = true;
+			p++;
+		}
+		op->width = (int)strtol(p, &end, 10);
+		p = end;
+		if (*p == '.') {
+			p++;
+			op->precision = (int)strtol(p, &end, 10);
+			if (end == p)
+				return NULL;
+			p = end;
+		}
+		if (op->width < 0 || op->width > SEGMENT_MAX_LENGTH - 1 ||
+		    op->precision < 0 || op->precision > SEGMENT_MAX_LENGTH - 1)
+			return NULL;
+	}
+	if (*p != '}')
+		return NULL;
 
-	len = sizeof(struct uvmexp);
+	format->count++;
+	return p + 1;
+}
 
-	struct uvmexp uvm_stats;
+// Compile a format template into a flat list of operations. Literal
+// text is copied, "{{" and "}}" stand for literal braces, and the
+// modules referenced by the template become the enabled modules. The
+// public IP fetchers only run if {ip} or {ipv6} is referenced. Returns
+// false with an error message if the template is invalid.
+static bool
+format_compile(struct Format *format, struct Config *config)
+{
+	char template[FORMAT_MAX_LENGTH];
+	const char *p, *run;
+	int i;
+
+	if (config->format != NULL) {
+		strlcpy(template, config->format, sizeof(template));
+		for (i = 0; i < MOD_COUNT; i++)
+			module_enable(config, i, 0);
+	} else {
+		default_format(config, template, sizeof(template));
+	}
 
-	if (sysctl(mib, 2, &uvm_stats, &len, NULL, 0) == -1) {
-		perror("sysctl");
-		exit(EXIT_FAILURE);
+	format->count = 0;
+	format->literals_used = 0;
+	for (p = run = template; *p != '\0';) {
+		if ((p[0] == '{' && p[1] == '{') ||
+		    (p[0] == '}' && p[1] == '}')) {
+			// Keep one brace of the pair in the literal run
+			if (!format_literal(format, run, p - run + 1))
+				goto toolong;
+			p += 2;
+			run = p;
+		} else if (*p == '{') {
+			if (!format_literal(format, run, p - run))
+				goto toolong;
+			run = format_field(format, p + 1);
+			if (run == NULL) {
+				fprintf(stderr,
+				    "Error: Invalid format field at: %s\n", p);
+				return false;
+			}
+			p = run;
+		} else {
+			p++;
+		}
+	}
+	if (!format_literal(format, run, p - run))
+		goto toolong;
+
+	config->public_ip = false;
+	for (i = 0; i < format->count; i++) {
+		const struct FormatOp *op = &format->ops[i];
+
+		if (op->literal)
+			continue;
+		if (field_info[op->field].module != -1)
+			module_enable(config, field_info[op->field].module, 1);
+		if (op->field == FIELD_IP || op->field == FIELD_IPV6)
+			config->public_ip = true;
 	}
+	return true;
 
-	freemem = (unsigned long long)uvm_stats.free *
-	    (unsigned long long)uvm_stats.pagesize / (1024 * 1024);
+toolong:
+	fprintf(stderr, "Error: Format template is too long\n");
+	return false;
+}
 
-	return freemem;
+// Shorten a UTF-8 string to at most length bytes without splitting a
+// multibyte character
+static size_t
+utf8_truncate(const char *text, size_t length)
+{
+	while (length > 0 && ((unsigned char)text[length] & 0xc0) == 0x80)
+		length--;
+	return length;
 }
 
-// Update CPU base speed by querying system information
-void
-update_cpu_base_speed()
+// Copy text to the write cursor, truncated to precision (if not
+// negative) and padded to width. Returns the advanced cursor.
+static char *
+format_emit(char *cursor, char *end, const char *text, size_t length,
+    const struct FormatOp *op)
 {
-	int temp = 0;
-	size_t templen = sizeof(temp);
+	size_t pad = 0;
 
-	int mib[5] = {CTL_HW, HW_CPUSPEED};
+	if (op->precision >= 0 && length > (size_t)op->precision)
+		length = utf8_truncate(text, op->precision);
+	if ((size_t)op->width > length)
+		pad = op->width - length;
 
-	if (sysctl(mib, 2, &temp, &templen, NULL, 0) == -1) {
-		perror("sysctl HW_CPUSPEED");
-		snprintf(cpu_base_speed, sizeof(cpu_base_speed), "error");
-	} else {
-		snprintf(
-		    cpu_base_speed, sizeof(cpu_base_speed), "%4dMhz", temp);
+	if (!op->left) {
+		for (; pad > 0 && cursor < end; pad--)
+			*cursor++ = ' ';
 	}
+	if (length > (size_t)(end - cursor))
+		length = utf8_truncate(text, end - cursor);
+	memcpy(cursor, text, length);
+	cursor += length;
+	for (; pad > 0 && cursor < end; pad--)
+		*cursor++ = ' ';
+	return cursor;
 }
 
-// Update CPU average speed by querying system information
-void
-update_cpu_avg_speed()
+// Write a rate in bytes per second with a binary unit prefix. Returns
+// the length written, as snprintf() does.
+static int
+format_rate(char *buffer, size_t size, double rate)
 {
-	uint64_t freq = 0;
-	size_t len = sizeof(freq);
-	int mib[2] = {CTL_HW, HW_CPUSPEED};
-	if (sysctl(mib, 2, &freq, &len, NULL, 0) == -1) {
-		fprintf(stderr, "Error: Failed to get CPU average speed\n");
-		return;
+	static const char *units[] = {"B/s", "K/s", "M/s", "G/s"};
+	int unit = 0;
+
+	while (rate >= 1000 && unit < 3) {
+		rate /= 1024;
+		unit++;
 	}
-	snprintf(cpu_avg_speed, sizeof(cpu_avg_speed), "%4lluMhz", freq);
+	return snprintf(buffer, size, unit == 0 ? "%.0f %s" : "%.1f %s", rate,
+	    units[unit]);
 }
 
-// Update system load averages
-void
-update_system_load(double *load_avg)
+// Render one field reference from the values published by its module
+static char *
+format_render_value(const struct Config *config, const struct FormatOp *op,
+    char *cursor, char *end)
 {
-	double load[3]; // Take 1, 5, and 15-minute load averages
-
-	if (getloadavg(load, 3) == -1) {
-		perror("getloadavg");
-		exit(EXIT_FAILURE);
+	struct FormatOp text_op = *op;
+	char number[32];
+	const char *text = NULL;
+	int length = -1;
+
+	switch (op->field) {
+	case FIELD_LOGO:
+		text = config->logo != NULL ? config->logo : "";
+		break;
+	case FIELD_HOSTNAME:
+		text = hostname;
+		break;
+	case FIELD_DATE:
+		text = datetime;
+		break;
+	case FIELD_CPU:
+		text = cpu_avg_speed;
+		break;
+	case FIELD_TEMP:
+		text = cpu_temp;
+		break;
+	case FIELD_MEM:
+		length = snprintf(number, sizeof(number), "%llu", free_memory);
+		break;
+	case FIELD_LOAD:
+	case FIELD_LOAD5:
+	case FIELD_LOAD15:
+		length = snprintf(number, sizeof(number), "%.*f",
+		    op->precision, system_load[op->field - FIELD_LOAD]);
+		break;
+	case FIELD_BAT:
+		text = battery_percent;
+		break;
+	case FIELD_AC:
+		text = battery_ac;
+		break;
+	case FIELD_BAT_TIME:
+		text = battery_time;
+		break;
+	case FIELD_VPN:
+		text = vpn_status;
+		break;
+	case FIELD_IP:
+		text = public_ip;
+		break;
+	case FIELD_IPV6:
+		text = public_ipv6;
+		break;
+	case FIELD_LAN:
+		text = internal_ip;
+		break;
+	case FIELD_USAGE:
+		length = snprintf(number, sizeof(number), "%.*f",
+		    op->precision, 100.0 - cpu_usage.idle);
+		break;
+	case FIELD_USAGE_USER:
+		length = snprintf(number, sizeof(number), "%.*f",
+		    op->precision, cpu_usage.user);
+		break;
+	case FIELD_USAGE_SYS:
+		length = snprintf(number, sizeof(number), "%.*f",
+		    op->precision, cpu_usage.sys);
+		break;
+	case FIELD_USAGE_INTR:
+		length = snprintf(number, sizeof(number), "%.*f",
+		    op->precision, cpu_usage.intr);
+		break;
+	case FIELD_USAGE_IDLE:
+		length = snprintf(number, sizeof(number), "%.*f",
+		    op->precision, cpu_usage.idle);
+		break;
+	case FIELD_CORES:
+		text = cpu_cores;
+		break;
+	case FIELD_RX:
+		length = format_rate(number, sizeof(number), traffic.rx_rate);
+		break;
+	case FIELD_TX:
+		length = format_rate(number, sizeof(number), traffic.tx_rate);
+		break;
+	case FIELD_LOAD_GRAPH:
+	case FIELD_MEM_GRAPH:
+	case FIELD_TEMP_GRAPH:
+	case FIELD_BAT_GRAPH:
+	case FIELD_USAGE_GRAPH:
+	case FIELD_RX_GRAPH:
+	case FIELD_TX_GRAPH:
+		length = history_sparkline(op->field - FIELD_LOAD_GRAPH,
+		    config->history, cursor, end - cursor);
+		return cursor + length;
 	}
 
-	for (int i = 0; i < 3; i++) {
-		load_avg[i] = load[i];
+	if (text != NULL)
+		return format_emit(cursor, end, text, strlen(text), op);
+
+	// Numbers are never truncated; their precision was applied above
+	text_op.precision = -1;
+	if (length < 0)
+		length = 0;
+	if ((size_t)length >= sizeof(number))
+		length = sizeof(number) - 1;
+	return format_emit(cursor, end, number, length, &text_op);
+}
+
+// Render one field reference from the latest consistent snapshot of its
+// module. A collector publishing at the same time makes the field render
+// again; the renderer never takes a lock.
+static char *
+format_render_field(const struct Config *config, const struct FormatOp *op,
+    char *cursor, char *end)
+{
+	int module = field_info[op->field].module;
+	unsigned int seq;
+	char *next;
+
+	if (module == -1)
+		return format_render_value(config, op, cursor, end);
+	do {
+		seq = module_read_begin(module);
+		next = format_render_value(config, op, cursor, end);
+	} while (module_read_retry(module, seq));
+	return next;
+}
+
+// Render the compiled format in a single linear pass with a tracked
+// write cursor, and mark the segments whose text changed as dirty.
+// Returns the number of dirty segments.
+static int
+update_segments(const struct Config *config, const struct Format *format,
+    struct Segment *segments)
+{
+	char line[FORMAT_MAX_LENGTH];
+	char *cursor = line, *end = line + sizeof(line) - 1;
+	int i, dirty = 0;
+
+	for (i = 0; i < format->count; i++) {
+		const struct FormatOp *op = &format->ops[i];
+		struct Segment *segment = &segments[i];
+		char *start = cursor;
+		size_t length;
+
+		if (op->literal)
+			cursor = format_emit(cursor, end, op->text, op->length,
+			    op);
+		else
+			cursor = format_render_field(config, op, cursor, end);
+
+		segment->graph = !op->literal &&
+		    op->field >= FIELD_LOAD_GRAPH &&
+		    op->field <= FIELD_TX_GRAPH;
+		length = cursor - start;
+		if (length > sizeof(segment->text) - 1)
+			length = utf8_truncate(start,
+			    sizeof(segment->text) - 1);
+		if (length == segment->length &&
+		    memcmp(start, segment->text, length) == 0)
+			continue;
+		memcpy(segment->text, start, length);
+		segment->text[length] = '\0';
+		segment->length = length;
+		segment->dirty = true;
+		dirty++;
 	}
+	return dirty;
 }
 
-// Update CPU temperature by querying system sensors
-void
-update_cpu_temp()
+// Parse the name of an output mode, or return -1
+static int
+parse_output(const char *value)
 {
-	struct sensor sensor;
-	size_t templen = sizeof(sensor);
-	int temp = -1;
+	if (strcmp(value, "x11") == 0)
+		return OUTPUT_X11;
+	if (strcmp(value, "text") == 0)
+		return OUTPUT_TEXT;
+	if (strcmp(value, "i3bar") == 0)
+		return OUTPUT_I3BAR;
+	if (strcmp(value, "shm") == 0)
+		return OUTPUT_SHM;
+	return -1;
+}
 
-	static int temp_mib = -1;
+// Bit of the sampled mask of the shared snapshot set by each module
+static const uint32_t shm_sampled_bit[MOD_COUNT] = {
+	[MOD_HOSTNAME] = OPENBAR_SHM_HOSTNAME,
+	[MOD_DATE] = OPENBAR_SHM_DATE,
+	[MOD_CPU] = OPENBAR_SHM_CPU,
+	[MOD_MEM] = OPENBAR_SHM_MEM,
+	[MOD_LOAD] = OPENBAR_SHM_LOAD,
+	[MOD_BAT] = OPENBAR_SHM_BAT | OPENBAR_SHM_AC | OPENBAR_SHM_BAT_TIME,
+	[MOD_VPN] = OPENBAR_SHM_VPN,
+	[MOD_NET] = OPENBAR_SHM_LAN,
+	[MOD_USAGE] = OPENBAR_SHM_USAGE,
+	[MOD_TRAFFIC] = OPENBAR_SHM_TRAFFIC,
+};
 
-	if (temp_mib == -1) {
-		for (temp_mib = 0; temp_mib < 20; temp_mib++) {
-			int mib[5] = {CTL_HW, HW_SENSORS, temp_mib, SENSOR_TEMP,
-				0}; // acpitz0.temp0 (x395)
-			if (sysctl(mib, 5, &sensor, &templen, NULL, 0) != -1)
-				break;
-		}
+// Copy the published values of one module into a shared snapshot. The
+// caller holds the read section of the module.
+static void
+shm_copy_module(struct OpenbarShm *next, int id)
+{
+	switch (id) {
+	case MOD_HOSTNAME:
+		strlcpy(next->hostname, hostname, sizeof(next->hostname));
+		break;
+	case MOD_DATE:
+		strlcpy(next->date, datetime, sizeof(next->date));
+		break;
+	case MOD_CPU:
+		strlcpy(next->cpu_speed, cpu_avg_speed,
+		    sizeof(next->cpu_speed));
+		strlcpy(next->cpu_temp, cpu_temp, sizeof(next->cpu_temp));
+		break;
+	case MOD_MEM:
+		next->free_memory = free_memory;
+		break;
+	case MOD_LOAD:
+		memcpy(next->load, system_load, sizeof(next->load));
+		break;
+	case MOD_BAT:
+		strlcpy(next->battery, battery_percent, sizeof(next->battery));
+		strlcpy(next->ac, battery_ac, sizeof(next->ac));
+		strlcpy(next->bat_time, battery_time, sizeof(next->bat_time));
+		break;
+	case MOD_VPN:
+		strlcpy(next->vpn, vpn_status, sizeof(next->vpn));
+		break;
+	case MOD_NET:
+		strlcpy(next->lan, internal_ip, sizeof(next->lan));
+		break;
+	case MOD_USAGE:
+		next->usage_user = cpu_usage.user;
+		next->usage_sys = cpu_usage.sys;
+		next->usage_intr = cpu_usage.intr;
+		next->usage_idle = cpu_usage.idle;
+		strlcpy(next->cores, cpu_cores, sizeof(next->cores));
+		break;
+	case MOD_TRAFFIC:
+		next->rx_rate = traffic.rx_rate;
+		next->tx_rate = traffic.tx_rate;
+		break;
 	}
+}
 
-	if (temp_mib != -1) {
-		int mib[5] = {CTL_HW, HW_SENSORS, temp_mib, SENSOR_TEMP, 0};
-		if (sysctl(mib, 5, &sensor, &templen, NULL, 0) != -1) {
-			temp = (sensor.value - 273150000) / 1000000.0;
-			snprintf(cpu_temp, sizeof(cpu_temp), "%d C", temp);
-			return;
-		}
+// Publish the latest values of every module to the shared region. The
+// snapshot is assembled on the stack, so the write section is a single
+// copy and readers spin for no longer than that.
+static void
+shm_publish(struct OpenbarShm *shm)
+{
+	const size_t start = offsetof(struct OpenbarShm, sampled);
+	struct OpenbarShm next;
+	unsigned int seq;
+	int id;
+
+	memset(&next, 0, sizeof(next));
+	for (id = 0; id < MOD_COUNT; id++) {
+		do {
+			seq = module_read_begin(id);
+			shm_copy_module(&next, id);
+		} while (module_read_retry(id, seq));
+		// A module that never published has a sequence of zero
+		if (seq != 0)
+			next.sampled |= shm_sampled_bit[id];
 	}
-	// If no valid temperature reading found, set to "x"
-	// specially for VMs
-	snprintf(cpu_temp, sizeof(cpu_temp), "x");
+	// The public addresses are only written by this thread
+	strlcpy(next.public_ip, public_ip, sizeof(next.public_ip));
+	strlcpy(next.public_ipv6, public_ipv6, sizeof(next.public_ipv6));
+
+	openbar_shm_write_begin(shm);
+	shm->updated = time(NULL);
+	memcpy((char *)shm + start, (char *)&next + start,
+	    sizeof(next) - start);
+	openbar_shm_write_end(shm);
 }
 
-// Update battery information by querying APM (Advanced Power Management)
-void
-update_battery()
+// Print the values published by a running "openbar -o shm" as
+// key=value lines, named after the format fields. Modules the daemon
+// never sampled are left out. Returns the exit status.
+static int
+shm_print(void)
 {
-	int fd;
-	struct apm_power_info pi;
+	const struct OpenbarShm *shm;
+	struct OpenbarShm copy;
 
-	if ((fd = open("/dev/apm", O_RDONLY)) == -1 ||
-	    ioctl(fd, APM_IOC_GETPOWER, &pi) == -1 || close(fd) == -1) {
-		strlcpy(battery_percent, "N/A", sizeof(battery_percent));
-		return;
+	if ((shm = openbar_shm_attach()) == NULL) {
+		perror("No shared snapshot");
+		return 1;
 	}
-
-	if (pi.ac_state == APM_AC_ON) {
-		snprintf(battery_percent, sizeof(battery_percent), "%d%%",
-		    pi.battery_life);
-	} else {
-		snprintf(battery_percent, sizeof(battery_percent), "%d%%",
-		    pi.battery_life);
+	if (!openbar_shm_read(shm, &copy)) {
+		fprintf(stderr, "Error: Unsupported or busy shared snapshot\n");
+		openbar_shm_detach(shm);
+		return 1;
+	}
+	openbar_shm_detach(shm);
+
+	if (copy.sampled & OPENBAR_SHM_HOSTNAME)
+		printf("hostname=%s\n", copy.hostname);
+	if (copy.sampled & OPENBAR_SHM_DATE)
+		printf("date=%s\n", copy.date);
+	if (copy.sampled & OPENBAR_SHM_CPU) {
+		printf("cpu=%s\n", copy.cpu_speed);
+		printf("temp=%s\n", copy.cpu_temp);
+	}
+	if (copy.sampled & OPENBAR_SHM_MEM)
+		printf("mem=%llu\n", (unsigned long long)copy.free_memory);
+	if (copy.sampled & OPENBAR_SHM_LOAD)
+		printf("load=%.2f\nload5=%.2f\nload15=%.2f\n", copy.load[0],
+		    copy.load[1], copy.load[2]);
+	if (copy.sampled & OPENBAR_SHM_USAGE) {
+		printf("usage=%.0f\n", 100.0 - copy.usage_idle);
+		printf("usage_user=%.0f\nusage_sys=%.0f\nusage_intr=%.0f\n",
+		    copy.usage_user, copy.usage_sys, copy.usage_intr);
+		printf("usage_idle=%.0f\n", copy.usage_idle);
+		printf("cores=%s\n", copy.cores);
 	}
+	if (copy.sampled & OPENBAR_SHM_TRAFFIC)
+		printf("rx=%.0f\ntx=%.0f\n", copy.rx_rate, copy.tx_rate);
+	if (copy.sampled & OPENBAR_SHM_BAT)
+		printf("bat=%s\n", copy.battery);
+	if (copy.sampled & OPENBAR_SHM_AC)
+		printf("ac=%s\n", copy.ac);
+	if (copy.sampled & OPENBAR_SHM_BAT_TIME)
+		printf("bat_time=%s\n", copy.bat_time);
+	if (copy.sampled & OPENBAR_SHM_VPN)
+		printf("vpn=%s\n", copy.vpn);
+	printf("ip=%s\n", copy.public_ip);
+	printf("ipv6=%s\n", copy.public_ipv6);
+	if (copy.sampled & OPENBAR_SHM_LAN)
+		printf("lan=%s\n", copy.lan);
+	printf("updated=%lld\n", (long long)copy.updated);
+	printf("pid=%lld\n", (long long)copy.pid);
+	return 0;
 }
 
-// Update date and time information
-void
-update_datetime()
+// Write text as the body of a JSON string
+static void
+output_json_string(const char *text, size_t length)
 {
-	time_t rawtime;
-	struct tm *timeinfo;
-	time(&rawtime);
-	timeinfo = localtime(&rawtime);
-	strftime(datetime, sizeof(datetime), "%a %d %b %H:%M", timeinfo);
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		unsigned char c = text[i];
+
+		if (c == '"' || c == '\\') {
+			putchar('\\');
+			putchar(c);
+		} else if (c < 0x20) {
+			printf("\\u%04x", c);
+		} else {
+			putchar(c);
+		}
+	}
 }
 
-// Create an Xlib window for displaying the status bar
-void
-create_window(Display *display, Window *window, GC *gc, int screen,
-    const struct Config *config)
+// Start the stream; the i3bar protocol opens with a header and an
+// endless array of status lines
+static void
+output_begin(enum output_mode mode)
 {
-	int screen_width = DisplayWidth(display, screen);
-	int window_width = screen_width;
-	int window_height = 30; // Fixed height for the bar
-
-	*window = XCreateSimpleWindow(display, RootWindow(display, screen), 0,
-	    0, window_width, window_height, 1, BlackPixel(display, screen),
-	    WhitePixel(display, screen));
-
-	XSelectInput(display, *window, ExposureMask | KeyPressMask);
-	XMapWindow(display, *window);
-
-	// Set window properties to make it unmanaged and always on top
-	Atom wm_state = XInternAtom(display, "_NET_WM_STATE", False);
-	Atom wm_state_above =
-	    XInternAtom(display, "_NET_WM_STATE_ABOVE", False);
-	Atom wm_bypass_wm =
-	    XInternAtom(display, "_NET_WM_BYPASS_COMPOSITOR", False);
-	Atom wm_state_skip_taskbar =
-	    XInternAtom(display, "_NET_WM_STATE_SKIP_TASKBAR", False);
-	Atom wm_state_skip_pager =
-	    XInternAtom(display, "_NET_WM_STATE_SKIP_PAGER", False);
-	Atom wm_state_sticky =
-	    XInternAtom(display, "_NET_WM_STATE_STICKY", False);
-	XMoveWindow(display, *window, 0, 0);
+	static char buffer[65536];
 
-	Atom wm_state_atoms[] = {wm_state_above, wm_bypass_wm,
-		wm_state_skip_taskbar, wm_state_skip_pager, wm_state_sticky};
-	XChangeProperty(display, *window, wm_state, XA_ATOM, 32,
-	    PropModeReplace, (unsigned char *)wm_state_atoms, 5);
+	// Each status line reaches the consumer with a single write(2)
+	setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+	if (mode == OUTPUT_I3BAR)
+		fputs("{\"version\":1}\n[\n", stdout);
+}
 
-	*gc = XCreateGC(display, *window, 0, NULL);
-	if (*gc == NULL) {
-		fprintf(stderr, "Cannot create graphics context\n");
-		exit(1);
-	}
+// Stream the whole status line. Callers only do so when a segment
+// changed, so consumers never see a repeated line; the shared region is
+// published after every change of any module. In i3bar mode every
+// segment is a block, named after its field, and blocks are joined
+// without separators so the line reads like the text mode one.
+static void
+output_line(enum output_mode mode, const struct Format *format,
+    const struct Segment *segments)
+{
+	static bool started;
+	bool first = true;
+	int i;
 
-	// Load and set the font for the GC
-	XFontStruct *font_info = XLoadQueryFont(
-	    display, config->font != NULL ? config->font : "fixed");
-	if (!font_info) {
-		font_info = XLoadQueryFont(display, "fixed");
+	if (mode == OUTPUT_SHM) {
+		shm_publish(shm_region);
+		return;
 	}
-	if (!font_info) {
-		fprintf(stderr, "Error: Failed to load font\n");
-		XFreeGC(display, *gc);
-		XCloseDisplay(display);
-		exit(1);
+	if (mode == OUTPUT_TEXT) {
+		for (i = 0; i < format->count; i++)
+			fwrite(segments[i].text, 1, segments[i].length, stdout);
+		putchar('\n');
+		fflush(stdout);
+		return;
 	}
-	XSetFont(display, *gc, font_info->fid);
 
-	Colormap colormap = DefaultColormap(display, screen);
-	XColor fg, bg;
-	unsigned long fg_pixel = BlackPixel(display, screen);
-	unsigned long bg_pixel = WhitePixel(display, screen);
-
-	if (config->foreground != NULL &&
-	    XAllocNamedColor(display, colormap, config->foreground, &fg, &fg)) {
-		fg_pixel = fg.pixel;
-	}
-	if (config->background != NULL &&
-	    XAllocNamedColor(display, colormap, config->background, &bg, &bg)) {
-		bg_pixel = bg.pixel;
+	fputs(started ? ",[" : "[", stdout);
+	started = true;
+	for (i = 0; i < format->count; i++) {
+		const struct FormatOp *op = &format->ops[i];
+
+		if (segments[i].length == 0)
+			continue;
+		if (!first)
+			putchar(',');
+		first = false;
+		fputs("{", stdout);
+		if (!op->literal)
+			printf("\"name\":\"%s\",", field_info[op->field].name);
+		fputs("\"full_text\":\"", stdout);
+		output_json_string(segments[i].text, segments[i].length);
+		fputs("\",\"separator\":false,\"separator_block_width\":0}",
+		    stdout);
 	}
+	fputs("]\n", stdout);
+	fflush(stdout);
+}
 
-	XSetForeground(display, *gc, fg_pixel);
-	XSetBackground(display, *gc, bg_pixel);
-	XSetWindowBackground(display, *window, bg_pixel);
-	XClearWindow(display, *window);
-	XMapRaised(display, *window);
+// Parse the iteration count of the benchmark mode, or return 0
+static int
+parse_iterations(const char *value)
+{
+	char *end;
+	unsigned long count;
+
+	count = strtoul(value, &end, 10);
+	if (end == value || *end != '\0' || count > 10000000)
+		return 0;
+	return (int)count;
 }
 
-// Draw text on the Xlib window
-void
-draw_text(Display *display, Window window, GC gc, const char *text)
+// Order tick durations for the percentile report
+static int
+compare_u64(const void *a, const void *b)
 {
-	XClearWindow(display, window);
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
 
-	// Get the width of the window
-	XWindowAttributes window_attributes;
-	XGetWindowAttributes(display, window, &window_attributes);
-	int window_width = window_attributes.width;
+	return (x > y) - (x < y);
+}
 
-	// Get the width of the text
-	XFontStruct *font_info = XQueryFont(display, XGContextFromGC(gc));
-	if (font_info == NULL) {
-		fprintf(stderr, "Error: Failed to query font information\n");
+// Print an average counter delta per tick, or n/a if not available
+static void
+bench_report_counter(const char *name, bool available, uint64_t before,
+    uint64_t after, int iterations, const char *note)
+{
+	if (!available) {
+		printf("%-14s n/a\n", name);
 		return;
 	}
-	int text_width = XTextWidth(font_info, text, strlen(text));
+	printf("%-14s %.2f%s\n", name,
+	    (double)(after - before) / iterations, note);
+}
 
-	// Calculate the starting position to center the text
-	int x_position = (window_width - text_width) / 2;
-	int y_position = 20; // Fixed y position
+// Run the sampling and formatting pipeline of a full tick, in which
+// every enabled module is due, without a display, and report its cost.
+// The interface snapshot is invalidated on every tick, as it would be
+// when ticks are seconds apart.
+static int
+bench_run(const struct Config *config, const struct Format *format,
+    int iterations)
+{
+	struct Segment segments[FORMAT_MAX_OPS];
+	uint64_t *samples;
+	uint64_t start, format_start, end, total = 0;
+	uint64_t rw_calls[2], allocs[2];
+	bool has_rw_calls, has_allocs;
+	int i, id;
+
+	samples = calloc(iterations, sizeof(*samples));
+	if (samples == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	memset(segments, 0, sizeof(segments));
+
+	has_rw_calls = platform_rw_calls(&rw_calls[0]);
+	has_allocs = platform_allocations(&allocs[0]);
+	for (i = 0; i < iterations; i++) {
+		start = monotonic_ns();
+		iface_cache.stale = true;
+		for (id = 0; id < MOD_COUNT; id++) {
+			if (module_enabled(config, id))
+				module_update(config, id);
+		}
+		format_start = monotonic_ns();
+		update_segments(config, format, segments);
+		end = monotonic_ns();
+		stat_record(STAT_FORMAT, end - format_start);
+		samples[i] = end - start;
+	}
+	has_allocs = has_allocs && platform_allocations(&allocs[1]);
+	has_rw_calls = has_rw_calls && platform_rw_calls(&rw_calls[1]);
+
+	for (i = 0; i < iterations; i++)
+		total += samples[i];
+	qsort(samples, iterations, sizeof(*samples), compare_u64);
+
+	printf("ticks          %d\n", iterations);
+	printf("ns/tick        p50 %llu p99 %llu min %llu max %llu "
+	       "mean %llu\n",
+	    (unsigned long long)samples[iterations / 2],
+	    (unsigned long long)samples[(iterations - 1) * 99 / 100],
+	    (unsigned long long)samples[0],
+	    (unsigned long long)samples[iterations - 1],
+	    (unsigned long long)(total / iterations));
+	bench_report_counter("rw calls/tick", has_rw_calls, rw_calls[0],
+	    rw_calls[1], iterations, "");
+	bench_report_counter("allocs/tick", has_allocs, allocs[0], allocs[1],
+	    iterations, "");
+
+	free(samples);
+	return 0;
+}
 
-	XDrawString(
-	    display, window, gc, x_position, y_position, text, strlen(text));
-	// Flush the display to ensure all commands are sent
-	XFlush(display);
+// Read the configuration file again and apply it in place. The X
+// connection, window and GCs are kept, fonts and colors are reloaded
+// only if they changed, and only the modules whose settings changed are
+// due again. An invalid file is reported and the running configuration
+// is kept. Returns whether the new configuration was applied.
+static bool
+config_reload(const char *path, struct Config *config, struct Format *format,
+    struct Scheduler *sched, struct PubipFetch *pubip, int *pubip_count,
+    struct Bars *bars)
+{
+	static struct Format scratch;
+	struct Config next, old;
+	int i;
+
+	if (!config_file(path, &next))
+		return false;
+	// The collectors read the configuration and the caches reset below
+	pool_drain();
+	if (bars != NULL)
+		load_xresources(bars->display, &next);
+	// Literal operations point into their Format, so the template is
+	// validated on a scratch copy before the live one is replaced
+	if (!format_compile(&scratch, &next)) {
+		free_config(&next);
+		return false;
+	}
+	format_compile(format, &next);
+
+	for (i = 0; bars != NULL && i < bars->count; i++)
+		restyle_window(&bars->bar[i], config, &next);
+	if (config_changed(config->sensor, next.sensor))
+		sensor_cache.scanned = false;
+
+	if (iface_cache.route_fd == -1 && (next.show_vpn || next.show_net)) {
+		iface_cache.route_fd = platform_route_open();
+		iface_cache.stale = true;
+	} else if (iface_cache.route_fd != -1 && !next.show_vpn &&
+	    !next.show_net) {
+		close(iface_cache.route_fd);
+		iface_cache.route_fd = -1;
+	}
+	if (power_fd == -1 && power_watched(&next)) {
+		power_fd = platform_power_open();
+	} else if (power_fd != -1 && !power_watched(&next)) {
+		close(power_fd);
+		power_fd = -1;
+	}
+	if (!next.show_bat && next.battery_stretch > 1)
+		power_source_read();
+
+	for (i = 0; i < PUBIP_FAMILIES; i++) {
+		if (next.public_ip)
+			pubip_reconfigure(&pubip[i], config, &next);
+		else
+			pubip_close(&pubip[i]);
+	}
+	*pubip_count = next.public_ip ? PUBIP_FAMILIES : 0;
+
+	// The workers read the configuration through the pointer given to
+	// pool_start(), so it is replaced while the pool is still idle, and
+	// only then may sched_reconfigure() queue new jobs
+	old = *config;
+	*config = next;
+	sched_reconfigure(sched, &old, config, monotonic_ns());
+	free_config(&old);
+	return true;
 }
 
 // Function declarations
-void draw_text(Display *display, Window window, GC gc, const char *text);
+void draw_segments(
+    struct Bar *bar, const struct Segment *segments, int count, bool full);
 void update_internal_ip(struct Config config);
+void restyle_window(
+    struct Bar *bar, const struct Config *old, const struct Config *config);
 
 // Main function
 int
@@ -801,25 +4730,47 @@ main(int argc, const char *argv[])
 	setlocale(LC_CTYPE, "C");
 	setlocale(LC_ALL, "en_US.UTF-8");
 
-	Display *display;
-	Window window;
-	GC gc;
-	int screen;
+	Display *display = NULL;
+	struct Bars bars;
 	int opt;
 	int run_once = 0;
+	int dump_stats = 0;
+	int bench_iterations = 0;
+	int output = OUTPUT_X11;
 	const char *config_override = NULL;
 	char *config_path;
 
-	while ((opt = getopt(argc, (char *const *)argv, "1c:")) != -1) {
+	while ((opt = getopt(argc, (char *const *)argv, "1B:c:o:rs")) != -1) {
 		switch (opt) {
 		case '1':
 			run_once = 1;
 			break;
+		case 'r':
+			return shm_print();
+		case 'B':
+			bench_iterations = parse_iterations(optarg);
+			if (bench_iterations == 0) {
+				fprintf(stderr, "Invalid iterations: %s\n",
+				    optarg);
+				return 1;
+			}
+			break;
 		case 'c':
 			config_override = optarg;
 			break;
+		case 'o':
+			output = parse_output(optarg);
+			if (output == -1) {
+				fprintf(stderr, "Invalid output: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 's':
+			dump_stats = 1;
+			break;
 		default:
-			fprintf(stderr, "Usage: openbar [-1] [-c path]\n");
+			fprintf(stderr, "Usage: openbar [-1rs] [-B iterations] "
+					"[-c path] [-o output]\n");
 			return 1;
 		}
 	}
@@ -830,169 +4781,480 @@ main(int argc, const char *argv[])
 		return 1;
 	}
 
-	if (unveil(config_path, "r") == -1 || unveil("/etc/hosts", "r") == -1 ||
-	    unveil("/etc/resolv.conf", "r") == -1 ||
-	    unveil("/etc/services", "r") == -1 ||
-	    unveil("/tmp/.X11-unix", "rw") == -1) {
-		perror("unveil");
+	platform_init();
+	if (bench_iterations == 0)
+		resolve_cache_path();
+
+	// In shm mode the bar samples without drawing, for other programs
+	// to read. The region is created before the sandbox, which would
+	// not let kill(2) check whether another daemon owns it.
+	if (output == OUTPUT_SHM && bench_iterations == 0 &&
+	    (shm_region = openbar_shm_create()) == NULL) {
+		if (errno == EEXIST)
+			fprintf(stderr, "Error: Another openbar -o shm is "
+			    "running\n");
+		else
+			perror("Failed to create the shared snapshot");
 		free(config_path);
 		return 1;
 	}
-
-	if (access("/dev/apm", R_OK) == 0 && unveil("/dev/apm", "r") == -1) {
-		perror("unveil");
+	if (platform_sandbox(config_path, pubip_cache_dir[0] != '\0' ?
+	    pubip_cache_dir : NULL, output == OUTPUT_SHM) == -1) {
+		if (shm_region != NULL)
+			openbar_shm_destroy(shm_region);
 		free(config_path);
 		return 1;
 	}
-	if (unveil(NULL, NULL) == -1) {
-		perror("unveil");
+
+	// Read the configuration file. The path is kept for reloads.
+	struct Config config;
+	if (!config_file(config_path, &config)) {
+		if (shm_region != NULL)
+			openbar_shm_destroy(shm_region);
 		free(config_path);
 		return 1;
 	}
 
-	if (pledge("stdio rpath inet dns unix sysctl ioctl", NULL) == -1) {
-		perror("pledge");
+	// Compile the status line layout; this also enables the modules
+	// it references
+	static struct Format format;
+	if (!format_compile(&format, &config)) {
+		if (shm_region != NULL)
+			openbar_shm_destroy(shm_region);
 		free(config_path);
+		free_config(&config);
 		return 1;
 	}
 
-	// Read the configuration file
-	struct Config config = config_file(config_path);
-	free(config_path);
-	if (config.logo == NULL) {
-		fprintf(
-		    stderr, "Error: Unable to read logo from config file\n");
+	if (bench_iterations > 0) {
+		int status = bench_run(&config, &format, bench_iterations);
+
+		if (dump_stats)
+			stats_dump();
+		free(config_path);
+		free_config(&config);
+		return status;
+	}
+
+	if (output == OUTPUT_X11) {
+		display = XOpenDisplay(NULL);
+		if (display == NULL) {
+			fprintf(stderr, "Cannot open display\n");
+			return 1;
+		}
+		load_xresources(display, &config);
+
+		// Create one bar window per monitor
+		bars_open(&bars, display, &config);
+
+		// Hide cursor in terminal
+		printf("\e[?25l");
+	} else if (output != OUTPUT_SHM) {
+		// Stream to stdout; no X connection is ever made
+		output_begin(output);
+	}
+
+	// Public IPs are fetched in the background by the event loop. A
+	// single update cycle never waits on the network: it shows the
+	// cached addresses, stale or not, or N/A.
+	struct PubipFetch pubip[PUBIP_FAMILIES];
+	int pubip_count = config.public_ip ? PUBIP_FAMILIES : 0;
+	pubip_init(&pubip[0], AF_INET, public_ip, sizeof(public_ip), &config);
+	pubip_init(
+	    &pubip[1], AF_INET6, public_ipv6, sizeof(public_ipv6), &config);
+	if (pubip_count > 0)
+		pubip_cache_load(pubip, pubip_count, monotonic_ns());
+
+	// Collectors run on the worker pool, and each finished job renders
+	// again. The first frame waits briefly for them, so it is not drawn
+	// empty; a collector that blocks shows up on a later frame. Without
+	// threads they run on this one.
+	int pool_fd = pool_start(&config);
+
+	// Sample every enabled module once before the first frame
+	struct Scheduler sched;
+	struct Segment segments[FORMAT_MAX_OPS];
+	memset(segments, 0, sizeof(segments));
+	if (!run_once && (config.show_vpn || config.show_net))
+		iface_cache.route_fd = platform_route_open();
+	if (!run_once && power_watched(&config))
+		power_fd = platform_power_open();
+	int clock_fd = run_once ? -1 : platform_clock_open();
+	if (!config.show_bat && config.battery_stretch > 1)
+		power_source_read();
+	sched_init(&sched, &config, monotonic_ns());
+	sched_run(&sched, &config, monotonic_ns());
+	sched_run_events(&config);
+	if (run_once && pool_fd != -1)
+		pool_drain();
+	else if (pool_fd != -1)
+		pool_wait(POOL_FIRST_FRAME);
+
+	update_segments(&config, &format, segments);
+	if (display != NULL)
+		bars_draw(&bars, segments, format.count, true);
+	else
+		output_line(output, &format, segments);
+	fflush(stdout);
+	if (run_once) {
+		if (pool_fd != -1)
+			pool_stop();
+		if (dump_stats)
+			stats_dump();
+		free(config_path);
+		free_config(&config);
+		if (display != NULL) {
+			bars_close(&bars);
+			XCloseDisplay(display);
+		}
+		return 0;
+	}
+
+	int timer_fd = platform_timer_open();
+	if (timer_fd == -1) {
+		perror("Failed to create tick timer");
 		return 1;
 	}
 
-	display = XOpenDisplay(NULL);
-	if (display == NULL) {
-		fprintf(stderr, "Cannot open display\n");
+	// The timer is always armed for the earliest module deadline.
+	// Deadlines are absolute, so the time spent sampling never
+	// accumulates into drift.
+	if (sched_next(&sched) != UINT64_MAX &&
+	    platform_timer_arm(timer_fd, sched_next(&sched)) == -1) {
+		perror("Failed to arm tick timer");
 		return 1;
 	}
-	screen = DefaultScreen(display);
-
-	load_xresources(display, &config);
-
-	// Create the Xlib window
-	create_window(display, &window, &gc, screen, &config);
-
-	// Hide cursor in terminal
-	printf("\e[?25l");
-
-	int ip_update_counter = 0;
-
-	while (1) {
-		char buffer[1024];
-		buffer[0] = '\0';
-
-		// Append logo to buffer if available
-		if (config.logo != NULL && strlen(config.logo) > 0) {
-			snprintf(buffer + strlen(buffer),
-			    sizeof(buffer) - strlen(buffer), "%s", config.logo);
-			snprintf(buffer + strlen(buffer),
-			    sizeof(buffer) - strlen(buffer), "|");
-		}
-
-		// Update and append hostname to buffer if enabled
-		if (config.show_hostname) {
-			char *hostname = get_hostname();
-			snprintf(buffer + strlen(buffer),
-			    sizeof(buffer) - strlen(buffer), " %s ", hostname);
-			snprintf(buffer + strlen(buffer),
-			    sizeof(buffer) - strlen(buffer), "|");
-		}
-
-		// Update and append date/time to buffer if enabled
-		if (config.show_date) {
-			update_datetime();
-			snprintf(buffer + strlen(buffer),
-			    sizeof(buffer) - strlen(buffer), " %s ", datetime);
-			snprintf(buffer + strlen(buffer),
-			    sizeof(buffer) - strlen(buffer), "|");
-		}
-
-		// Update and append CPU information to buffer if enabled
-		if (config.show_cpu) {
-			update_cpu_temp();
-			update_cpu_avg_speed();
-			update_cpu_base_speed();
-			snprintf(buffer + strlen(buffer),
-			    sizeof(buffer) - strlen(buffer), " CPU: %s (%s) ",
-			    cpu_avg_speed, cpu_temp);
-			snprintf(buffer + strlen(buffer),
-			    sizeof(buffer) - strlen(buffer), "|");
-		}
-
-		// Update and append memory information to buffer if enabled
-		if (config.show_mem) {
-			free_memory = update_mem();
-			snprintf(buffer + strlen(buffer),
-			    sizeof(buffer) - strlen(buffer), " Mem: %.0llu MB ",
-			    free_memory);
-			snprintf(buffer + strlen(buffer),
-			    sizeof(buffer) - strlen(buffer), "|");
-		}
-
-		// Update and append system load to buffer if enabled
-		if (config.show_load) {
-			update_system_load(system_load);
-			snprintf(buffer + strlen(buffer),
-			    sizeof(buffer) - strlen(buffer), " Load: %.2f ",
-			    system_load[0]);
-			snprintf(buffer + strlen(buffer),
-			    sizeof(buffer) - strlen(buffer), "|");
-		}
-
-		// Update and append battery information to buffer if enabled
-		if (config.show_bat) {
-			update_battery();
-			snprintf(buffer + strlen(buffer),
-			    sizeof(buffer) - strlen(buffer), " Bat: %s ",
-			    battery_percent);
-			snprintf(buffer + strlen(buffer),
-			    sizeof(buffer) - strlen(buffer), "|");
-		}
-
-		// Update and append VPN status to buffer if enabled
-		if (config.show_vpn) {
-			update_vpn();
-			snprintf(buffer + strlen(buffer),
-			    sizeof(buffer) - strlen(buffer), "|");
-		}
-
-		// Update and append network information to buffer if enabled
-		if (config.show_net) {
-			if (ip_update_counter == 0) {
-				update_public_ip();
-				update_public_ipv6();
+
+	// SIGUSR1 dumps the stats at any time; with -s they are dumped on
+	// exit, and the shared region is removed on exit, so termination
+	// signals end the loop instead of the process. The handlers also
+	// write to a pipe the loop polls, so none is left waiting for the
+	// next wakeup.
+	int signal_fd = signal_open();
+	install_signal(SIGUSR1, stats_signal);
+	install_signal(SIGHUP, reload_signal);
+	if (dump_stats || output == OUTPUT_SHM) {
+		install_signal(SIGINT, quit_signal);
+		install_signal(SIGTERM, quit_signal);
+	}
+
+	// Sampling pauses while the bars cannot be seen
+	bool paused = false, power_pending = false;
+
+	while (!quit_requested) {
+		struct pollfd pfd[7 + PUBIP_FAMILIES];
+		int slot[PUBIP_FAMILIES];
+		uint64_t now, wake, start;
+		int nfds = 0, timer_slot, route_slot = -1, power_slot = -1;
+		int pool_slot = -1, signal_slot = -1, clock_slot = -1;
+		unsigned int stretch;
+		bool changed = false;
+
+		if (stats_requested) {
+			stats_requested = 0;
+			stats_dump();
+		}
+
+		// SIGHUP applies the configuration file again, in place
+		if (reload_requested) {
+			reload_requested = 0;
+			if (config_reload(config_path, &config, &format, &sched,
+			    pubip, &pubip_count,
+			    display != NULL ? &bars : NULL)) {
+				now = monotonic_ns();
+				sched_run(&sched, &config, now);
+				memset(segments, 0, sizeof(segments));
+				update_segments(&config, &format, segments);
+				if (display != NULL)
+					bars_draw(&bars, segments,
+					    format.count, true);
+				else
+					output_line(output, &format, segments);
+				if (sched_next(&sched) != UINT64_MAX &&
+				    platform_timer_arm(timer_fd,
+				    sched_next(&sched)) == -1) {
+					perror("Failed to arm tick timer");
+					break;
+				}
 			}
-			update_internal_ip(config);
-			snprintf(buffer + strlen(buffer),
-			    sizeof(buffer) - strlen(buffer),
-			    " IPs: %s | %s ~ %s ", public_ip,
-			    public_ipv6, internal_ip);
 		}
 
-		// Draw the buffer text on the Xlib window
-		draw_text(display, window, gc, buffer);
+		// Drain the X event queue so exposes are repainted at once
+		while (display != NULL && XPending(display) > 0) {
+			struct Bar *bar;
+			XEvent event;
+
+			XNextEvent(display, &event);
+			// Monitors were plugged, unplugged or rearranged
+			if (bars_randr_event(&bars, &event)) {
+				if (bars_update(&bars, &config))
+					bars_draw(&bars, segments,
+					    format.count, true);
+				continue;
+			}
+			if (bars_saver_event(&bars, &event))
+				continue;
+			switch (event.type) {
+			case VisibilityNotify:
+				bar = bars_find(&bars,
+				    event.xvisibility.window);
+				if (bar != NULL)
+					bar->obscured =
+					    event.xvisibility.state ==
+					    VisibilityFullyObscured;
+				break;
+			case Expose:
+				// Served from the back buffer without sampling
+				// or laying out again
+				bar = bars_find(&bars, event.xexpose.window);
+				if (bar != NULL)
+					present_buffer(bar, event.xexpose.x,
+					    event.xexpose.y,
+					    event.xexpose.width,
+					    event.xexpose.height);
+				break;
+			case ConfigureNotify:
+				// The centered layout moves with the size
+				bar = bars_find(&bars, event.xconfigure.window);
+				if (bar != NULL &&
+				    (event.xconfigure.width != bar->width ||
+				    event.xconfigure.height != bar->height)) {
+					resize_buffer(bar,
+					    event.xconfigure.width,
+					    event.xconfigure.height);
+					draw_segments(bar, segments,
+					    format.count, true);
+				}
+				break;
+			}
+		}
 
-		// Flush the display to ensure all commands are sent
-		XFlush(display);
+		// Modules that fell due while the bars were hidden are
+		// sampled as soon as they show again, each once
+		if (paused && !bars_hidden(&bars)) {
+			paused = false;
+			now = monotonic_ns();
+			sched_run(&sched, &config, now);
+			sched_run_events(&config);
+			if (power_pending)
+				module_sample(&config, MOD_BAT);
+			power_pending = false;
+			if (pool_fd == -1)
+				changed = true;
+			if (sched_next(&sched) != UINT64_MAX &&
+			    platform_timer_arm(timer_fd,
+			    sched_next(&sched)) == -1) {
+				perror("Failed to arm tick timer");
+				break;
+			}
+		}
 
-		ip_update_counter = (ip_update_counter + 1) % 10;
+		// On battery the intervals grow by battery_stretch
+		stretch = __atomic_load_n(&on_battery, __ATOMIC_RELAXED) ?
+		    config.battery_stretch : 1;
+		if (sched.stretch != stretch) {
+			sched_stretch(&sched, stretch);
+			if (!paused && sched_next(&sched) != UINT64_MAX &&
+			    platform_timer_arm(timer_fd,
+			    sched_next(&sched)) == -1) {
+				perror("Failed to arm tick timer");
+				break;
+			}
+		}
 
-		fflush(stdout);
-		if (run_once) {
+		if (display != NULL) {
+			pfd[nfds].fd = ConnectionNumber(display);
+			pfd[nfds].events = POLLIN;
+			pfd[nfds++].revents = 0;
+		}
+		timer_slot = nfds;
+		pfd[nfds].fd = timer_fd;
+		pfd[nfds].events = POLLIN;
+		pfd[nfds++].revents = 0;
+		if (iface_cache.route_fd != -1) {
+			route_slot = nfds;
+			pfd[nfds].fd = iface_cache.route_fd;
+			pfd[nfds].events = POLLIN;
+			pfd[nfds++].revents = 0;
+		}
+		if (power_fd != -1) {
+			power_slot = nfds;
+			pfd[nfds].fd = power_fd;
+			pfd[nfds].events = POLLIN;
+			pfd[nfds++].revents = 0;
+		}
+		if (pool_fd != -1) {
+			pool_slot = nfds;
+			pfd[nfds].fd = pool_fd;
+			pfd[nfds].events = POLLIN;
+			pfd[nfds++].revents = 0;
+		}
+		if (signal_fd != -1) {
+			signal_slot = nfds;
+			pfd[nfds].fd = signal_fd;
+			pfd[nfds].events = POLLIN;
+			pfd[nfds++].revents = 0;
+		}
+		if (clock_fd != -1) {
+			clock_slot = nfds;
+			pfd[nfds].fd = clock_fd;
+			pfd[nfds].events = POLLIN;
+			pfd[nfds++].revents = 0;
+		}
+		// While paused no new public IP fetch starts; the ones in
+		// flight finish
+		wake = pubip_pollfds(pubip, pubip_count, pfd, &nfds, slot,
+		    !paused);
+
+		now = monotonic_ns();
+		if (poll(pfd, nfds, changed ? 0 :
+		    wake == UINT64_MAX ? -1 : poll_timeout(wake, now)) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
 			break;
 		}
-		usleep(2000000); // Sleep for 2 seconds
+		now = monotonic_ns();
+
+		// The flags are handled at the top of the next iteration
+		if (signal_slot != -1 && (pfd[signal_slot].revents & POLLIN))
+			signal_drain();
+
+		// A wall clock step or a resume from suspend moves the minute
+		// boundaries the date is aligned to. The clock descriptor
+		// wakes the loop for them, and every wakeup compares the
+		// clocks, which also catches the steps it does not report.
+		if (clock_slot != -1 && (pfd[clock_slot].revents & POLLIN))
+			platform_clock_changed(clock_fd);
+		if (sched_clock_check(&sched, now) && !paused) {
+			if (sched_run(&sched, &config, now) > 0 &&
+			    pool_fd == -1)
+				changed = true;
+			if (sched_next(&sched) != UINT64_MAX &&
+			    platform_timer_arm(timer_fd,
+			    sched_next(&sched)) == -1) {
+				perror("Failed to arm tick timer");
+				break;
+			}
+		}
+
+		if (pfd[timer_slot].revents & POLLIN) {
+			platform_timer_ack(timer_fd);
+			if (display != NULL)
+				bars_poll_dpms(&bars, now);
+		}
+
+		// Nothing is sampled while the bars are hidden; the timer
+		// stays disarmed, except to notice DPMS turning the monitors
+		// back on
+		if ((pfd[timer_slot].revents & POLLIN) && display != NULL &&
+		    bars_hidden(&bars)) {
+			paused = true;
+			if (bars.dpms_off &&
+			    platform_timer_arm(timer_fd,
+			    now + BLANK_RECHECK) == -1) {
+				perror("Failed to arm tick timer");
+				break;
+			}
+		} else if (pfd[timer_slot].revents & POLLIN) {
+			// Lateness of the wakeup against the armed deadline
+			stat_record(STAT_JITTER,
+			    now > sched_next(&sched) ?
+			    now - sched_next(&sched) : 0);
+			if (sched_run(&sched, &config, now) > 0 &&
+			    pool_fd == -1)
+				changed = true;
+			if (sched_next(&sched) != UINT64_MAX &&
+			    platform_timer_arm(timer_fd,
+			    sched_next(&sched)) == -1) {
+				perror("Failed to arm tick timer");
+				break;
+			}
+		}
+
+		// Interface changes refresh the snapshot at once; idle
+		// interfaces cost nothing. While paused the event-driven
+		// modules are sampled on resume instead.
+		if (route_slot != -1 && (pfd[route_slot].revents & POLLIN) &&
+		    iface_route_changed(&iface_cache) && !paused) {
+			sched_run_events(&config);
+			if (pool_fd == -1)
+				changed = true;
+		}
+
+		// Plugging or unplugging the AC adapter shows at once, without
+		// waiting for the battery interval, or on resume while paused
+		if (power_slot != -1 && (pfd[power_slot].revents & POLLIN) &&
+		    platform_power_changed(power_fd)) {
+			if (!config.show_bat) {
+				power_source_read();
+			} else if (paused) {
+				power_pending = true;
+			} else {
+				module_sample(&config, MOD_BAT);
+				if (pool_fd == -1)
+					changed = true;
+			}
+		}
+
+		// Collectors finished on the workers have published new values
+		if (pool_slot != -1 && (pfd[pool_slot].revents & POLLIN) &&
+		    pool_notified())
+			changed = true;
+
+		start = monotonic_ns();
+		if (pubip_dispatch(pubip, pubip_count, pfd, slot, now, !paused))
+			changed = true;
+		if (pubip_count > 0)
+			stat_record(STAT_PUBIP, monotonic_ns() - start);
+
+		// Only segments whose text changed are repainted
+		if (changed) {
+			int dirty;
+
+			start = monotonic_ns();
+			dirty = update_segments(&config, &format, segments);
+			now = monotonic_ns();
+			stat_record(STAT_FORMAT, now - start);
+			if (dirty > 0 || output == OUTPUT_SHM) {
+				if (display != NULL)
+					bars_draw(&bars, segments,
+					    format.count, false);
+				else
+					output_line(output, &format, segments);
+				stat_record(STAT_RENDER, monotonic_ns() - now);
+			}
+			fflush(stdout);
+		}
+	}
+
+	if (pool_fd != -1)
+		pool_stop();
+	if (dump_stats)
+		stats_dump();
+
+	close(timer_fd);
+	if (iface_cache.route_fd != -1)
+		close(iface_cache.route_fd);
+	if (power_fd != -1)
+		close(power_fd);
+	if (clock_fd != -1)
+		close(clock_fd);
+	if (signal_fd != -1) {
+		close(signal_pipe[0]);
+		close(signal_pipe[1]);
 	}
+	if (shm_region != NULL)
+		openbar_shm_destroy(shm_region);
 
 	// Free allocated memory for config.logo and config.interface
+	free(config_path);
 	free_config(&config);
 
-	// Close the Xlib display
-	XCloseDisplay(display);
+	// Release the bar resources and close the Xlib display
+	if (display != NULL) {
+		bars_close(&bars);
+		XCloseDisplay(display);
+	}
 	return 0;
 }
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2024 Gonzalo Rodriguez <gonzalo@x61.sh>
+ * Copyright (c) 2024-2026 David David Uhden Collado <david@uhden.dev>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef OPENBAR_H
+#define OPENBAR_H
+
+#include <netdb.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC 1000000000ULL
+
+#define SENSOR_MAX 64
+#define CPU_MAX 256
+
+// glibc only provides strlcpy(3) and strlcat(3) since 2.38
+#ifdef __GLIBC__
+#if !__GLIBC_PREREQ(2, 38)
+#define OPENBAR_COMPAT_STRLCPY
+size_t strlcpy(char *dst, const char *src, size_t size);
+size_t strlcat(char *dst, const char *src, size_t size);
+#endif
+#endif
+
+// The SensorEntry structure describes one temperature sensor found by the
+// platform backend: its "device.name" key and the backend coordinates
+// used to read it (sysctl indices on OpenBSD, the thermal zone number and
+// an open descriptor on Linux).
+struct SensorEntry {
+	char name[48];
+	int dev;
+	int index;
+	int fd;
+};
+
+// The SensorCache structure is the table of temperature sensors built
+// by a single walk of the sensor tree. selected is the entry read by the
+// CPU module, or -1, and devices is the number of device slots walked.
+struct SensorCache {
+	struct SensorEntry entries[SENSOR_MAX];
+	int count;
+	int selected;
+	int devices;
+	bool scanned;
+};
+
+// AC adapter states reported by platform_power()
+enum power_ac {
+	POWER_AC_UNKNOWN,
+	POWER_AC_OFFLINE,
+	POWER_AC_ONLINE
+};
+
+// The PowerInfo structure holds a battery reading. percent is -1 when no
+// battery charge is known.
+struct PowerInfo {
+	enum power_ac ac_state;
+	int percent;
+};
+
+// The CpuTimes structure holds the cumulative time one CPU spent in each
+// state, in clock ticks. Only differences between two samples matter.
+struct CpuTimes {
+	uint64_t user;
+	uint64_t nice;
+	uint64_t sys;
+	uint64_t intr;
+	uint64_t idle;
+};
+
+// An asynchronous name resolution started by platform_resolve_start()
+struct ResolveQuery;
+
+// An entry of the getifaddrs(3) list
+struct ifaddrs;
+
+// The ResolveWait structure tells the caller what an unfinished
+// resolution waits for: readiness of fd for the poll(2) events, or at
+// most timeout milliseconds (-1 for no limit).
+struct ResolveWait {
+	int fd;
+	short events;
+	int timeout;
+};
+
+uint64_t monotonic_ns(void);
+
+// Platform backend, implemented by platform-openbsd.c and
+// platform-linux.c. Collectors return false when the value is not
+// available on this machine.
+void platform_init(void);
+int platform_sandbox(const char *config_path, const char *cache_dir,
+    bool shared_memory);
+bool platform_free_memory(unsigned long long *megabytes);
+bool platform_cpu_speed(int *mhz);
+int platform_cpu_times(struct CpuTimes *times, int max);
+bool platform_load(double load[3]);
+void platform_sensor_scan(struct SensorCache *cache);
+bool platform_sensor_hotplug(const struct SensorCache *cache);
+bool platform_sensor_read(const struct SensorEntry *entry, int *celsius);
+bool platform_power(struct PowerInfo *info);
+int platform_power_open(void);
+bool platform_power_changed(int fd);
+int platform_route_open(void);
+bool platform_route_changed(int fd);
+bool platform_iface_bytes(const struct ifaddrs *ifa, uint64_t *rx,
+    uint64_t *tx, unsigned int *bits);
+int platform_timer_open(void);
+int platform_timer_arm(int fd, uint64_t deadline);
+void platform_timer_ack(int fd);
+int platform_clock_open(void);
+bool platform_clock_changed(int fd);
+struct ResolveQuery *platform_resolve_start(
+    const char *host, const char *port, const struct addrinfo *hints);
+int platform_resolve_run(struct ResolveQuery *query, struct addrinfo **res,
+    struct ResolveWait *wait);
+void platform_resolve_abort(struct ResolveQuery *query);
+void platform_random(void *buffer, size_t size);
+bool platform_rw_calls(uint64_t *count);
+bool platform_allocations(uint64_t *count);
+
+#endif
@@ -0,0 +1,782 @@
+/*
+ * Copyright (c) 2024 Gonzalo Rodriguez <gonzalo@x61.sh>
+ * Copyright (c) 2024-2026 David David Uhden Collado <david@uhden.dev>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+
+#define _GNU_SOURCE
+
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "openbar.h"
+
+// Descriptors kept open for the lifetime of the process. Every sample
+// re-reads them from offset zero with pread(2) instead of opening,
+// reading and closing the file again.
+static int meminfo_fd = -1;
+static int loadavg_fd = -1;
+static int cpuinfo_fd = -1;
+static int stat_fd = -1;
+static int cpufreq_fd[CPU_MAX];
+static int cpufreq_count;
+static int battery_fd = -1;
+static int mains_fd = -1;
+static int io_fd = -1;
+
+#ifdef OPENBAR_COUNT_ALLOCS
+// Heap allocations made by the whole process, counted by the malloc
+// wrappers below for the benchmark mode
+static uint64_t allocations;
+#endif
+
+// The ResolveQuery structure is a getaddrinfo(3) call running on its own
+// thread. The thread writes a byte to fds[1] when it is done, so that
+// the caller can wait for fds[0] in its poll(2) set. The query is freed
+// by whichever of the thread and the caller releases it last.
+struct ResolveQuery {
+	pthread_mutex_t lock;
+	int refs;
+	int fds[2];
+	char *host;
+	char *port;
+	struct addrinfo hints;
+	struct addrinfo *res;
+	int error;
+};
+
+#ifdef OPENBAR_COMPAT_STRLCPY
+size_t
+strlcpy(char *dst, const char *src, size_t size)
+{
+	size_t length = strlen(src);
+
+	if (size > 0) {
+		size_t n = length < size - 1 ? length : size - 1;
+
+		memcpy(dst, src, n);
+		dst[n] = '\0';
+	}
+	return length;
+}
+
+size_t
+strlcat(char *dst, const char *src, size_t size)
+{
+	size_t used = strnlen(dst, size);
+
+	if (used == size)
+		return size + strlen(src);
+	return used + strlcpy(dst + used, src, size - used);
+}
+#endif
+
+// Read a whole pseudo-file from its start into a NUL-terminated buffer
+static bool
+read_fd(int fd, char *buffer, size_t size)
+{
+	ssize_t n;
+
+	if (fd == -1)
+		return false;
+	n = pread(fd, buffer, size - 1, 0);
+	if (n <= 0)
+		return false;
+	buffer[n] = '\0';
+	return true;
+}
+
+// Open a file for reading with pread(2), or return -1
+static int
+open_path(const char *path)
+{
+	return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+// Find the first battery and AC adapter in the power supply class
+static void
+power_open(void)
+{
+	char path[PATH_MAX], type[32];
+	struct dirent *dp;
+	DIR *dir;
+	int fd;
+
+	if ((dir = opendir("/sys/class/power_supply")) == NULL)
+		return;
+	while ((dp = readdir(dir)) != NULL) {
+		if (dp->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/power_supply/%s/type",
+		    dp->d_name);
+		fd = open_path(path);
+		if (!read_fd(fd, type, sizeof(type))) {
+			if (fd != -1)
+				close(fd);
+			continue;
+		}
+		close(fd);
+		if (battery_fd == -1 && strncmp(type, "Battery", 7) == 0) {
+			snprintf(path, sizeof(path),
+			    "/sys/class/power_supply/%s/capacity", dp->d_name);
+			battery_fd = open_path(path);
+		} else if (mains_fd == -1 && strncmp(type, "Mains", 5) == 0) {
+			snprintf(path, sizeof(path),
+			    "/sys/class/power_supply/%s/online", dp->d_name);
+			mains_fd = open_path(path);
+		}
+	}
+	closedir(dir);
+}
+
+// Open the /proc and /sys files sampled by the collectors
+void
+platform_init(void)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	meminfo_fd = open_path("/proc/meminfo");
+	loadavg_fd = open_path("/proc/loadavg");
+	stat_fd = open_path("/proc/stat");
+
+	for (cpufreq_count = 0; cpufreq_count < CPU_MAX; cpufreq_count++) {
+		snprintf(path, sizeof(path),
+		    "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_cur_freq",
+		    cpufreq_count);
+		if ((fd = open_path(path)) == -1)
+			break;
+		cpufreq_fd[cpufreq_count] = fd;
+	}
+	// Without cpufreq, e.g. in most virtual machines, fall back to the
+	// clock reported by /proc/cpuinfo
+	if (cpufreq_count == 0)
+		cpuinfo_fd = open_path("/proc/cpuinfo");
+
+	power_open();
+}
+
+// There is no unveil(2) or pledge(2) on Linux
+int
+platform_sandbox(const char *config_path, const char *cache_dir,
+    bool shared_memory)
+{
+	(void)config_path;
+	(void)cache_dir;
+	(void)shared_memory;
+	return 0;
+}
+
+// Return available memory in megabytes from /proc/meminfo
+bool
+platform_free_memory(unsigned long long *megabytes)
+{
+	char buffer[4096];
+	const char *p;
+	unsigned long long kb;
+
+	if (!read_fd(meminfo_fd, buffer, sizeof(buffer))) {
+		perror("/proc/meminfo");
+		return false;
+	}
+	// MemAvailable accounts for reclaimable caches; kernels older than
+	// 3.14 only have MemFree
+	if ((p = strstr(buffer, "MemAvailable:")) == NULL &&
+	    (p = strstr(buffer, "MemFree:")) == NULL)
+		return false;
+	p = strchr(p, ':') + 1;
+	kb = strtoull(p, NULL, 10);
+	*megabytes = kb / 1024;
+	return true;
+}
+
+// Return the average current clock of all CPUs in MHz
+bool
+platform_cpu_speed(int *mhz)
+{
+	char buffer[4096];
+	unsigned long long total = 0;
+	const char *p;
+	int i, count = 0;
+
+	for (i = 0; i < cpufreq_count; i++) {
+		if (!read_fd(cpufreq_fd[i], buffer, sizeof(buffer)))
+			continue;
+		total += strtoull(buffer, NULL, 10); // kHz
+		count++;
+	}
+	if (count > 0) {
+		*mhz = (int)(total / count / 1000);
+		return true;
+	}
+
+	if (!read_fd(cpuinfo_fd, buffer, sizeof(buffer)) ||
+	    (p = strstr(buffer, "cpu MHz")) == NULL ||
+	    (p = strchr(p, ':')) == NULL)
+		return false;
+	*mhz = (int)strtod(p + 1, NULL);
+	return true;
+}
+
+// Fill times with the per-CPU counters of the "cpuN" lines of /proc/stat
+// and return the number of CPUs, or -1. iowait counts as idle time and
+// softirq as interrupt time.
+int
+platform_cpu_times(struct CpuTimes *times, int max)
+{
+	static char buffer[32768];
+	unsigned long long v[7];
+	const char *p;
+	int count = 0;
+
+	if (!read_fd(stat_fd, buffer, sizeof(buffer)))
+		return -1;
+	// The aggregate "cpu " line comes first and is skipped
+	for (p = buffer; (p = strstr(p, "\ncpu")) != NULL && count < max;) {
+		p += 4;
+		if (*p < '0' || *p > '9')
+			break;
+		while (*p >= '0' && *p <= '9')
+			p++;
+		if (sscanf(p, "%llu %llu %llu %llu %llu %llu %llu", &v[0],
+		    &v[1], &v[2], &v[3], &v[4], &v[5], &v[6]) != 7)
+			break;
+		times[count].user = v[0];
+		times[count].nice = v[1];
+		times[count].sys = v[2];
+		times[count].idle = v[3] + v[4];
+		times[count].intr = v[5] + v[6];
+		count++;
+	}
+	return count > 0 ? count : -1;
+}
+
+// Return the 1, 5 and 15-minute load averages from /proc/loadavg
+bool
+platform_load(double load[3])
+{
+	char buffer[128];
+
+	if (!read_fd(loadavg_fd, buffer, sizeof(buffer)))
+		return false;
+	return sscanf(buffer, "%lf %lf %lf", &load[0], &load[1], &load[2]) ==
+	    3;
+}
+
+// Enumerate the thermal zones once and keep the temperature file of
+// each one open. Entries are named after the zone type, e.g.
+// "x86_pkg_temp.temp0", so that sensor= accepts the same forms as on
+// OpenBSD.
+void
+platform_sensor_scan(struct SensorCache *cache)
+{
+	char path[PATH_MAX], type[32];
+	struct SensorEntry *entry;
+	int zone, fd, i;
+
+	for (i = 0; i < cache->count; i++) {
+		if (cache->entries[i].fd != -1)
+			close(cache->entries[i].fd);
+	}
+
+	cache->count = 0;
+	for (zone = 0; cache->count < SENSOR_MAX; zone++) {
+		snprintf(path, sizeof(path),
+		    "/sys/class/thermal/thermal_zone%d/type", zone);
+		if ((fd = open_path(path)) == -1)
+			break;
+		if (!read_fd(fd, type, sizeof(type)))
+			strlcpy(type, "thermal", sizeof(type));
+		close(fd);
+		type[strcspn(type, "\n")] = '\0';
+
+		snprintf(path, sizeof(path),
+		    "/sys/class/thermal/thermal_zone%d/temp", zone);
+		if ((fd = open_path(path)) == -1)
+			continue;
+		entry = &cache->entries[cache->count++];
+		snprintf(entry->name, sizeof(entry->name), "%s.temp%d", type,
+		    zone);
+		entry->dev = zone;
+		entry->index = 0;
+		entry->fd = fd;
+	}
+	cache->devices = zone;
+}
+
+// Return whether a thermal zone appeared since the last scan
+bool
+platform_sensor_hotplug(const struct SensorCache *cache)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "/sys/class/thermal/thermal_zone%d",
+	    cache->devices);
+	return access(path, F_OK) == 0;
+}
+
+// Read a thermal zone in degrees Celsius with a single pread(2)
+bool
+platform_sensor_read(const struct SensorEntry *entry, int *celsius)
+{
+	char buffer[32];
+
+	if (!read_fd(entry->fd, buffer, sizeof(buffer)))
+		return false;
+	*celsius = (int)(strtol(buffer, NULL, 10) / 1000); // millidegrees
+	return true;
+}
+
+// Read the battery charge and the AC adapter state
+bool
+platform_power(struct PowerInfo *info)
+{
+	char buffer[32];
+
+	if (!read_fd(battery_fd, buffer, sizeof(buffer)))
+		return false;
+	info->percent = (int)strtol(buffer, NULL, 10);
+
+	info->ac_state = POWER_AC_UNKNOWN;
+	if (read_fd(mains_fd, buffer, sizeof(buffer)))
+		info->ac_state = buffer[0] == '1' ? POWER_AC_ONLINE :
+		    POWER_AC_OFFLINE;
+	return true;
+}
+
+// Open a NETLINK_KOBJECT_UEVENT socket receiving the kernel uevents,
+// among which the power supply class reports AC plug and unplug and
+// battery changes
+int
+platform_power_open(void)
+{
+	struct sockaddr_nl snl;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    NETLINK_KOBJECT_UEVENT);
+	if (fd == -1)
+		return -1;
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	snl.nl_groups = 1; // Kernel events, as opposed to udev's
+	if (bind(fd, (struct sockaddr *)&snl, sizeof(snl)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Drain the uevent socket. Returns true if any event came from the power
+// supply class, or if the socket overflowed (ENOBUFS) and events were
+// dropped. Each event is a series of NUL-terminated KEY=value strings
+// after an action@devpath header.
+bool
+platform_power_changed(int fd)
+{
+	char buffer[4096];
+	bool changed = false;
+	ssize_t n;
+
+	while ((n = recv(fd, buffer, sizeof(buffer) - 1, 0)) > 0) {
+		char *key = buffer, *end = buffer + n;
+
+		buffer[n] = '\0';
+		for (; key < end; key += strlen(key) + 1) {
+			if (strcmp(key, "SUBSYSTEM=power_supply") == 0) {
+				changed = true;
+				break;
+			}
+		}
+	}
+	if (n == -1 && errno == ENOBUFS)
+		changed = true;
+	return changed;
+}
+
+// Open a NETLINK_ROUTE socket subscribed to link and address changes
+int
+platform_route_open(void)
+{
+	struct sockaddr_nl snl;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    NETLINK_ROUTE);
+	if (fd == -1)
+		return -1;
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	snl.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+	if (bind(fd, (struct sockaddr *)&snl, sizeof(snl)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Drain the netlink socket. Returns true if any message reported an
+// interface or address change, or if the socket overflowed (ENOBUFS) and
+// messages were dropped, since the change they carried is unknown.
+bool
+platform_route_changed(int fd)
+{
+	char buffer[4096];
+	bool changed = false;
+	ssize_t n;
+
+	while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+		struct nlmsghdr *nlh = (struct nlmsghdr *)buffer;
+		int length = (int)n;
+
+		for (; NLMSG_OK(nlh, length); nlh = NLMSG_NEXT(nlh, length)) {
+			switch (nlh->nlmsg_type) {
+			case RTM_NEWADDR:
+			case RTM_DELADDR:
+			case RTM_NEWLINK:
+			case RTM_DELLINK:
+				changed = true;
+				break;
+			}
+		}
+	}
+	if (n == -1 && errno == ENOBUFS)
+		changed = true;
+	return changed;
+}
+
+// Return the byte counters of an interface from its AF_PACKET entry in
+// the getifaddrs(3) list, which carries a struct rtnl_link_stats. Its
+// counters are 32 bits wide and wrap around.
+bool
+platform_iface_bytes(const struct ifaddrs *ifa, uint64_t *rx, uint64_t *tx,
+    unsigned int *bits)
+{
+	const struct rtnl_link_stats *stats = ifa->ifa_data;
+
+	if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_PACKET ||
+	    stats == NULL)
+		return false;
+	*rx = stats->rx_bytes;
+	*tx = stats->tx_bytes;
+	*bits = 32;
+	return true;
+}
+
+// Fill a buffer with random bytes, for the transaction IDs of the public
+// IP resolvers. Before the entropy pool is ready the clock has to do.
+void
+platform_random(void *buffer, size_t size)
+{
+	unsigned char *p = buffer;
+	uint64_t x;
+	size_t i;
+
+	if (getrandom(buffer, size, GRND_NONBLOCK) == (ssize_t)size)
+		return;
+	x = monotonic_ns() ^ ((uint64_t)getpid() << 32);
+	for (i = 0; i < size; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		p[i] = (unsigned char)x;
+	}
+}
+
+// Create the descriptor that becomes readable at each timer deadline
+int
+platform_timer_open(void)
+{
+	return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+}
+
+// Arm the timer to fire at an absolute monotonic deadline
+int
+platform_timer_arm(int fd, uint64_t deadline)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = deadline / NSEC_PER_SEC;
+	its.it_value.tv_nsec = deadline % NSEC_PER_SEC;
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1; // A zero value disarms the timer
+	return timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// Consume the pending expiration of the timer
+void
+platform_timer_ack(int fd)
+{
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) == -1 &&
+	    errno != EAGAIN)
+		perror("read timerfd");
+}
+
+// Arm a wall clock timer far in the future, only to be cancelled when the
+// clock is set
+static int
+clock_arm(int fd)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = LONG_MAX;
+	return timerfd_settime(fd,
+	    TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+}
+
+// Open a descriptor that becomes readable when the wall clock is set or
+// the system resumes from suspend, which the monotonic clock does not
+// count: a CLOCK_REALTIME timerfd cancelled on either. Returns -1 on
+// failure.
+int
+platform_clock_open(void)
+{
+	int fd;
+
+	fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	if (clock_arm(fd) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Consume a wall clock change and watch for the next one. Returns true
+// if the clock was set.
+bool
+platform_clock_changed(int fd)
+{
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) != -1 ||
+	    errno != ECANCELED)
+		return false;
+	clock_arm(fd);
+	return true;
+}
+
+// Drop one reference to a query, freeing it with the last one
+static void
+resolve_release(struct ResolveQuery *query)
+{
+	int refs;
+
+	pthread_mutex_lock(&query->lock);
+	refs = --query->refs;
+	pthread_mutex_unlock(&query->lock);
+	if (refs > 0)
+		return;
+
+	close(query->fds[0]);
+	close(query->fds[1]);
+	if (query->res != NULL)
+		freeaddrinfo(query->res);
+	free(query->host);
+	free(query->port);
+	pthread_mutex_destroy(&query->lock);
+	free(query);
+}
+
+// Resolver thread: run the blocking getaddrinfo(3) and signal completion
+static void *
+resolve_thread(void *arg)
+{
+	struct ResolveQuery *query = arg;
+	char byte = 0;
+
+	query->error = getaddrinfo(query->host, query->port, &query->hints,
+	    &query->res);
+	if (write(query->fds[1], &byte, 1) == -1)
+		perror("write");
+	resolve_release(query);
+	return NULL;
+}
+
+// Start resolving a name on a detached thread. glibc has no resolver
+// that can be driven from a poll(2) loop, so the completion is reported
+// through a socket pair instead.
+struct ResolveQuery *
+platform_resolve_start(
+    const char *host, const char *port, const struct addrinfo *hints)
+{
+	struct ResolveQuery *query;
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	if ((query = calloc(1, sizeof(*query))) == NULL)
+		return NULL;
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+	    query->fds) == -1) {
+		free(query);
+		return NULL;
+	}
+	query->host = strdup(host);
+	query->port = strdup(port);
+	query->hints = *hints;
+	query->refs = 2;
+	pthread_mutex_init(&query->lock, NULL);
+	if (query->host == NULL || query->port == NULL)
+		goto fail;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, resolve_thread, query) != 0) {
+		pthread_attr_destroy(&attr);
+		goto fail;
+	}
+	pthread_attr_destroy(&attr);
+	return query;
+
+fail:
+	query->refs = 1;
+	resolve_release(query);
+	return NULL;
+}
+
+// Drive a resolution. Returns 0 and fills wait while it is in progress,
+// or 1 once it completed, with *res set to the result or NULL on error.
+// The query is released on completion.
+int
+platform_resolve_run(struct ResolveQuery *query, struct addrinfo **res,
+    struct ResolveWait *wait)
+{
+	char byte;
+
+	if (read(query->fds[0], &byte, 1) != 1) {
+		wait->fd = query->fds[0];
+		wait->events = POLLIN;
+		wait->timeout = -1;
+		return 0;
+	}
+	// The thread is done with the query once it has written the byte
+	*res = NULL;
+	if (query->error == 0) {
+		*res = query->res;
+		query->res = NULL;
+	}
+	resolve_release(query);
+	return 1;
+}
+
+// Abandon a resolution in progress. The thread cannot be cancelled, so
+// it finishes on its own and frees the query.
+void
+platform_resolve_abort(struct ResolveQuery *query)
+{
+	resolve_release(query);
+}
+
+// Return the number of read and write system calls made so far, from
+// /proc/self/io. Other system calls are not accounted there.
+bool
+platform_rw_calls(uint64_t *count)
+{
+	char buffer[256];
+	const char *p;
+
+	if (io_fd == -1)
+		io_fd = open_path("/proc/self/io");
+	if (!read_fd(io_fd, buffer, sizeof(buffer)) ||
+	    (p = strstr(buffer, "syscr:")) == NULL)
+		return false;
+	*count = strtoull(p + strlen("syscr:"), NULL, 10);
+	if ((p = strstr(buffer, "syscw:")) == NULL)
+		return false;
+	*count += strtoull(p + strlen("syscw:"), NULL, 10);
+	return true;
+}
+
+#ifdef OPENBAR_COUNT_ALLOCS
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+// Interpose the glibc allocator to count allocations, including those
+// made inside libc such as by getifaddrs(3)
+void *
+malloc(size_t size)
+{
+	__atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	__atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	__atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+// Return the number of heap allocations made so far
+bool
+platform_allocations(uint64_t *count)
+{
+	*count = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+	return true;
+}
+#else
+// Allocations are only counted in builds with OPENBAR_COUNT_ALLOCS
+bool
+platform_allocations(uint64_t *count)
+{
+	(void)count;
+	return false;
+}
+#endif
+
+#endif
@@ -0,0 +1,488 @@
+/*
+ * Copyright (c) 2024 Gonzalo Rodriguez <gonzalo@x61.sh>
+ * Copyright (c) 2024-2026 David David Uhden Collado <david@uhden.dev>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __OpenBSD__
+
+#include <sys/event.h>
+#include <sys/ioctl.h>
+#include <sys/sched.h>
+#include <sys/sensors.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <net/if.h>
+#include <net/route.h>
+
+#include <asr.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <machine/apmvar.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "openbar.h"
+
+// Number of CPUs configured in the kernel, read once at startup
+static int ncpu = 1;
+
+// The APM device, opened once and kept for the lifetime of the process.
+// It is both queried for the battery state and watched for power events.
+static int apm_fd = -1;
+
+// Read the CPU count and open the APM device
+void
+platform_init(void)
+{
+	int mib[2] = {CTL_HW, HW_NCPU};
+	size_t len = sizeof(ncpu);
+
+	if (sysctl(mib, 2, &ncpu, &len, NULL, 0) == -1 || ncpu < 1)
+		ncpu = 1;
+	apm_fd = open("/dev/apm", O_RDONLY | O_CLOEXEC);
+}
+
+// Restrict filesystem access with unveil(2) and syscalls with pledge(2).
+// cache_dir, when not NULL, is where the public IP cache is rewritten.
+// shm_open(3) keeps shared memory objects in /tmp.
+int
+platform_sandbox(const char *config_path, const char *cache_dir,
+    bool shared_memory)
+{
+	const char *promises = "stdio rpath inet dns unix sysctl ioctl route";
+
+	if (unveil(config_path, "r") == -1 || unveil("/etc/hosts", "r") == -1 ||
+	    unveil("/etc/resolv.conf", "r") == -1 ||
+	    unveil("/etc/services", "r") == -1 ||
+	    unveil("/tmp/.X11-unix", "rw") == -1) {
+		perror("unveil");
+		return -1;
+	}
+
+	if (cache_dir != NULL && unveil(cache_dir, "rwc") == -1) {
+		perror("unveil");
+		return -1;
+	}
+	if (shared_memory && unveil("/tmp", "rwc") == -1) {
+		perror("unveil");
+		return -1;
+	}
+	if (unveil(NULL, NULL) == -1) {
+		perror("unveil");
+		return -1;
+	}
+
+	// Files are only written for the cache and the shared memory
+	if (cache_dir != NULL || shared_memory)
+		promises = "stdio rpath wpath cpath inet dns unix sysctl ioctl "
+		    "route";
+	if (pledge(promises, NULL) == -1) {
+		perror("pledge");
+		return -1;
+	}
+	return 0;
+}
+
+// Return free memory in megabytes from the UVM statistics
+bool
+platform_free_memory(unsigned long long *megabytes)
+{
+	int mib[2] = {CTL_VM, VM_UVMEXP};
+	size_t len;
+
+	len = sizeof(struct uvmexp);
+
+	struct uvmexp uvm_stats;
+
+	if (sysctl(mib, 2, &uvm_stats, &len, NULL, 0) == -1) {
+		perror("sysctl");
+		return false;
+	}
+
+	*megabytes = (unsigned long long)uvm_stats.free *
+	    (unsigned long long)uvm_stats.pagesize / (1024 * 1024);
+	return true;
+}
+
+// Return the CPU speed in MHz
+bool
+platform_cpu_speed(int *mhz)
+{
+	int speed = 0;
+	size_t len = sizeof(speed);
+	int mib[2] = {CTL_HW, HW_CPUSPEED};
+
+	if (sysctl(mib, 2, &speed, &len, NULL, 0) == -1)
+		return false;
+	*mhz = speed;
+	return true;
+}
+
+// Fill times with one KERN_CPTIME2 sample per CPU and return the number
+// of CPUs, or -1. Spinning counts as system time. CPUs taken offline by
+// hw.smt report ENODEV and are returned as all zeroes.
+int
+platform_cpu_times(struct CpuTimes *times, int max)
+{
+	u_int64_t cp_time[CPUSTATES];
+	int mib[3] = {CTL_KERN, KERN_CPTIME2, 0};
+	size_t len;
+	int i, count;
+
+	count = ncpu < max ? ncpu : max;
+	for (i = 0; i < count; i++) {
+		mib[2] = i;
+		len = sizeof(cp_time);
+		if (sysctl(mib, 3, cp_time, &len, NULL, 0) == -1) {
+			if (errno != ENODEV)
+				return -1;
+			memset(&times[i], 0, sizeof(times[i]));
+			continue;
+		}
+		times[i].user = cp_time[CP_USER];
+		times[i].nice = cp_time[CP_NICE];
+		times[i].sys = cp_time[CP_SYS] + cp_time[CP_SPIN];
+		times[i].intr = cp_time[CP_INTR];
+		times[i].idle = cp_time[CP_IDLE];
+	}
+	return count;
+}
+
+// Return the 1, 5 and 15-minute load averages
+bool
+platform_load(double load[3])
+{
+	return getloadavg(load, 3) != -1;
+}
+
+// Enumerate the whole sensor tree once and cache every temperature
+// sensor, keyed by device name and sensor index
+void
+platform_sensor_scan(struct SensorCache *cache)
+{
+	struct sensordev sensordev;
+	struct sensor sensor;
+	size_t sdlen, slen;
+	int mib[5] = {CTL_HW, HW_SENSORS, 0, SENSOR_TEMP, 0};
+	int dev, i;
+
+	cache->count = 0;
+	for (dev = 0;; dev++) {
+		mib[2] = dev;
+		sdlen = sizeof(sensordev);
+		if (sysctl(mib, 3, &sensordev, &sdlen, NULL, 0) == -1) {
+			if (errno == ENXIO)
+				continue; // Detached device, keep going
+			break;        // ENOENT: past the last device
+		}
+		for (i = 0; i < sensordev.maxnumt[SENSOR_TEMP] &&
+		    cache->count < SENSOR_MAX; i++) {
+			struct SensorEntry *entry;
+
+			mib[4] = i;
+			slen = sizeof(sensor);
+			if (sysctl(mib, 5, &sensor, &slen, NULL, 0) == -1 ||
+			    (sensor.flags & SENSOR_FINVALID))
+				continue;
+			entry = &cache->entries[cache->count++];
+			snprintf(entry->name, sizeof(entry->name), "%s.temp%d",
+			    sensordev.xname, i);
+			entry->dev = dev;
+			entry->index = i;
+			entry->fd = -1;
+		}
+	}
+	cache->devices = dev;
+}
+
+// Return whether a sensor device attached since the last scan. Only the
+// first unused device slot is probed, with a single sysctl.
+bool
+platform_sensor_hotplug(const struct SensorCache *cache)
+{
+	struct sensordev sensordev;
+	size_t sdlen = sizeof(sensordev);
+	int mib[3] = {CTL_HW, HW_SENSORS, cache->devices};
+
+	return sysctl(mib, 3, &sensordev, &sdlen, NULL, 0) == 0;
+}
+
+// Read a sensor in degrees Celsius with a single sysctl
+bool
+platform_sensor_read(const struct SensorEntry *entry, int *celsius)
+{
+	struct sensor sensor;
+	size_t slen = sizeof(sensor);
+	int mib[5] = {CTL_HW, HW_SENSORS, entry->dev, SENSOR_TEMP,
+		entry->index};
+
+	if (sysctl(mib, 5, &sensor, &slen, NULL, 0) == -1 ||
+	    (sensor.flags & SENSOR_FINVALID))
+		return false;
+	*celsius = (sensor.value - 273150000) / 1000000.0;
+	return true;
+}
+
+// Query APM (Advanced Power Management) for the battery state
+bool
+platform_power(struct PowerInfo *info)
+{
+	struct apm_power_info pi;
+
+	if (apm_fd == -1 || ioctl(apm_fd, APM_IOC_GETPOWER, &pi) == -1)
+		return false;
+
+	switch (pi.ac_state) {
+	case APM_AC_ON:
+		info->ac_state = POWER_AC_ONLINE;
+		break;
+	case APM_AC_OFF:
+		info->ac_state = POWER_AC_OFFLINE;
+		break;
+	default:
+		info->ac_state = POWER_AC_UNKNOWN;
+		break;
+	}
+	info->percent = pi.battery_life;
+	return true;
+}
+
+// Create the descriptor that becomes readable on power events: a kqueue
+// watching the APM device, which reports AC plug and unplug, battery
+// level changes and resume
+int
+platform_power_open(void)
+{
+	struct kevent kev;
+	int kq;
+
+	if (apm_fd == -1 || (kq = kqueue()) == -1)
+		return -1;
+	EV_SET(&kev, apm_fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+	if (kevent(kq, &kev, 1, NULL, 0, NULL) == -1) {
+		close(kq);
+		return -1;
+	}
+	return kq;
+}
+
+// Drain the pending power events. Returns true if any was reported.
+bool
+platform_power_changed(int fd)
+{
+	struct kevent kev[8];
+	struct timespec zero = {0, 0};
+	int n;
+
+	if ((n = kevent(fd, NULL, 0, kev, 8, &zero)) == -1) {
+		perror("kevent");
+		return false;
+	}
+	return n > 0;
+}
+
+// Open a descriptor that becomes readable when the system resumes from
+// suspend: another kqueue on the APM device. Setting the wall clock
+// reports no event, so a step is only noticed on the next wakeup.
+int
+platform_clock_open(void)
+{
+	return platform_power_open();
+}
+
+// Drain the pending APM events. Returns true if any was reported; the
+// caller compares the clocks to tell a resume from the other events.
+bool
+platform_clock_changed(int fd)
+{
+	return platform_power_changed(fd);
+}
+
+// Open a PF_ROUTE socket reporting interface and address changes
+int
+platform_route_open(void)
+{
+	unsigned int filter = ROUTE_FILTER(RTM_NEWADDR) |
+	    ROUTE_FILTER(RTM_DELADDR) | ROUTE_FILTER(RTM_IFINFO);
+	int fd;
+
+	fd = socket(AF_ROUTE, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+	if (setsockopt(fd, AF_ROUTE, ROUTE_MSGFILTER, &filter,
+	    sizeof(filter)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Drain the routing socket. Returns true if any message reported an
+// interface or address change.
+bool
+platform_route_changed(int fd)
+{
+	char buffer[4096];
+	bool changed = false;
+	ssize_t n;
+
+	while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+		struct rt_msghdr *rtm = (struct rt_msghdr *)buffer;
+
+		if ((size_t)n < sizeof(*rtm) || rtm->rtm_version != RTM_VERSION)
+			continue;
+		switch (rtm->rtm_type) {
+		case RTM_NEWADDR:
+		case RTM_DELADDR:
+		case RTM_IFINFO:
+			changed = true;
+			break;
+		}
+	}
+	return changed;
+}
+
+// Return the byte counters of an interface from its AF_LINK entry in the
+// getifaddrs(3) list, which carries the struct if_data of the interface.
+// Its counters are 64 bits wide.
+bool
+platform_iface_bytes(const struct ifaddrs *ifa, uint64_t *rx, uint64_t *tx,
+    unsigned int *bits)
+{
+	const struct if_data *data = ifa->ifa_data;
+
+	if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_LINK ||
+	    data == NULL)
+		return false;
+	*rx = data->ifi_ibytes;
+	*tx = data->ifi_obytes;
+	*bits = 64;
+	return true;
+}
+
+// Fill a buffer with random bytes, for the transaction IDs of the public
+// IP resolvers
+void
+platform_random(void *buffer, size_t size)
+{
+	arc4random_buf(buffer, size);
+}
+
+// Create the descriptor that becomes readable at each timer deadline: a
+// kqueue holding a single timer event
+int
+platform_timer_open(void)
+{
+	return kqueue();
+}
+
+// Arm the timer to fire at an absolute monotonic deadline. kqueue timers
+// are relative, so the deadline is converted each time the timer is
+// armed; the deadline itself never drifts.
+int
+platform_timer_arm(int fd, uint64_t deadline)
+{
+	struct kevent kev;
+	uint64_t now = monotonic_ns();
+	int64_t timeout = 1;
+
+	if (deadline > now)
+		timeout = (deadline - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+	EV_SET(&kev, 1, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, timeout, NULL);
+	return kevent(fd, &kev, 1, NULL, 0, NULL);
+}
+
+// Consume the pending expiration of the timer
+void
+platform_timer_ack(int fd)
+{
+	struct kevent kev;
+	struct timespec zero = {0, 0};
+
+	if (kevent(fd, NULL, 0, &kev, 1, &zero) == -1)
+		perror("kevent");
+}
+
+// Start resolving a name with the asynchronous resolver of asr(3)
+struct ResolveQuery *
+platform_resolve_start(
+    const char *host, const char *port, const struct addrinfo *hints)
+{
+	return (struct ResolveQuery *)getaddrinfo_async(host, port, hints,
+	    NULL);
+}
+
+// Drive a resolution. Returns 0 and fills wait while it is in progress,
+// or 1 once it completed, with *res set to the result or NULL on error.
+// The query is released on completion.
+int
+platform_resolve_run(struct ResolveQuery *query, struct addrinfo **res,
+    struct ResolveWait *wait)
+{
+	struct asr_result ar;
+
+	if (asr_run((struct asr_query *)query, &ar) == 0) {
+		wait->fd = ar.ar_fd;
+		wait->events = (ar.ar_cond == ASR_WANT_READ) ? POLLIN : POLLOUT;
+		wait->timeout = ar.ar_timeout;
+		return 0;
+	}
+	*res = ar.ar_gai_errno == 0 ? ar.ar_addrinfo : NULL;
+	return 1;
+}
+
+// Abandon a resolution in progress
+void
+platform_resolve_abort(struct ResolveQuery *query)
+{
+	asr_abort((struct asr_query *)query);
+}
+
+// There is no per-process read and write counter; ktrace(1) -t c and
+// kdump(1) list every system call instead
+bool
+platform_rw_calls(uint64_t *count)
+{
+	(void)count;
+	return false;
+}
+
+// Allocations are only counted with the glibc malloc wrappers
+bool
+platform_allocations(uint64_t *count)
+{
+	(void)count;
+	return false;
+}
+
+#endif